@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,17 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To have several disk operations in flight at once, start
+//     each with bread_async or bwrite_async, then call bwait
+//     on each buffer before using its data or releasing it.
+//
+// Each buffer lives on the chain of the bucket that (dev, blockno)
+// hashes to, and each bucket has its own lock, so lookups of
+// different blocks rarely contend.  A buffer is recycled by
+// moving it from its old bucket to the new one; bcache.lock
+// serializes recycling, so only a process holding it changes
+// the chains.  The victim is the unused buffer that was
+// released longest ago, according to its lastuse timestamp.
 
 
 #include "types.h"
@@ -23,69 +34,206 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 31
+
+struct bucket {
+  struct spinlock lock;  // protects refcnt and lastuse of its bufs
+  struct buf *head;      // chain through buf.next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // held while moving a buf between buckets
+  struct bucket bucket[NBUCKET];
+  int nbuf;
 } bcache;
 
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 67 + blockno) % NBUCKET];
+}
+
+// Allocate the buffers, 1/BUFMEM of the free memory
+// but at least NBUF of them, a page at a time.
 void
 binit(void)
 {
   struct buf *b;
+  char *pg;
+  int i, n, perpage;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
+
+  perpage = PGSIZE / sizeof(struct buf);
+  n = kfreemem() / BUFMEM / sizeof(struct buf);
+  if(n < NBUF)
+    n = NBUF;
+  n = (n + perpage - 1) / perpage * perpage;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(i = 0; i < n; i += perpage){
+    if((pg = kalloc()) == 0)
+      panic("binit: kalloc");
+    for(b = (struct buf*)pg; b < (struct buf*)pg + perpage; b++){
+      initsleeplock(&b->lock, "buffer");
+      b->dev = 0;
+      b->blockno = 0;
+      b->valid = 0;
+      b->disk = 0;
+      b->qpoll = 0;
+      b->iodone = 0;
+      b->refcnt = 0;
+      b->lastuse = 0;
+      // spread the unused buffers over the buckets.
+      b->next = bcache.bucket[bcache.nbuf % NBUCKET].head;
+      bcache.bucket[bcache.nbuf % NBUCKET].head = b;
+      bcache.nbuf++;
+    }
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// How many buffers binit() made.
+int
+bcount(void)
+{
+  return bcache.nbuf;
+}
+
+// Look for a cached copy of the block in bk, whose lock
+// the caller holds. Takes a reference if found.
 static struct buf*
-bget(uint dev, uint blockno)
+lookup(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+// Find the unused buffer released longest ago, take it off
+// its bucket's chain and give it one reference.
+// Caller holds bcache.lock, so the chains don't change
+// under the unlocked scan; refcnt and lastuse may, so
+// they are checked again with the bucket locked.
+static struct buf*
+recycle(void)
+{
+  struct buf *b, *victim, **pp;
+  struct bucket *bk, *vbk;
+
+  for(;;){
+    victim = 0;
+    vbk = 0;
+    for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+      for(b = bk->head; b; b = b->next){
+        if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+          victim = b;
+          vbk = bk;
+        }
+      }
+    }
+    if(victim == 0)
+      panic("bget: no buffers");
+
+    acquire(&vbk->lock);
+    if(victim->refcnt == 0){
+      for(pp = &vbk->head; *pp != victim; pp = &(*pp)->next)
+        ;
+      *pp = victim->next;
+      victim->refcnt = 1;
+      release(&vbk->lock);
+      return victim;
     }
+    // someone found it in the cache meanwhile.
+    release(&vbk->lock);
   }
-  panic("bget: no buffers");
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct bucket *bk = hash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  b = lookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Check again holding bcache.lock, since
+  // another process may have recycled a buffer for the
+  // same block in the meantime.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = lookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  b = recycle();
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block, with a read
+// of its contents started if they aren't cached. Call bwait
+// before looking at the data.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  // if a read-ahead is fetching it, bwait waits for that.
+  if(!b->valid && !b->disk)
+    virtio_disk_start(b, 0);
+  return b;
+}
+
+// Start writing b's contents to disk. Must be locked.
+// Call bwait before changing or releasing b.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for the disk operation started on locked b, if any.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+  b->valid = 1;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +242,94 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
+}
+
+// Called by the disk interrupt when a read-ahead finishes.
+static void
+readahead_done(struct buf *b)
+{
+  b->valid = 1;
+  b->iodone = 0;
+  bunpin(b);
+}
+
+// Start reading the block into the cache, if it isn't
+// there already, but don't wait for the disk. The read
+// holds a reference until readahead_done().
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk = hash(dev, blockno);
+  struct buf *b;
+
+  // don't wait for the lock on a buffer someone is using.
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return;
+
   b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+  if(!b->valid && !b->disk){
+    b->iodone = readahead_done;
+    bpin(b);
+    virtio_disk_start(b, 0);
   }
-  return b;
+  brelse(b);
 }
 
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwrite_async(b);
+  bwait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else is using it, timestamp it for LRU recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = r_time();
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  if(b->refcnt == 0)
+    b->lastuse = r_time();
+  release(&bk->lock);
 }
 
-
@@ -1,12 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  void (*iodone)(struct buf*); // if set, called by the disk interrupt
+  int qwrite;        // disk: queued for a write, not a read
+  int qpoll;         // disk: its waiter is polling, not asleep
+  uint64 qtime;      // disk: when it was queued
+  struct buf *qnext; // disk: request queue, and merged requests
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint64 lastuse;   // when refcnt last dropped to 0, for LRU
+  struct buf *next; // hash bucket chain
   uchar data[BSIZE];
 };
 
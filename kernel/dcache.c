@@ -0,0 +1,163 @@
+// Directory entry cache.
+//
+// Remembers what dirlookup() found: the i-number that a name
+// in a directory refers to, or that the directory has no such
+// name (a negative entry), so that looking up a path again
+// needn't read the directories along it.
+//
+// A directory's entries are only looked up and filled in while
+// its inode is locked, at least shared, and only changed by
+// dirlink(), unlink and create() while it is locked exclusive;
+// so a hit always agrees with the directory. dcache.lock
+// protects the table itself. When the table is full, the
+// oldest entry is replaced.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDCACHE 256
+#define NDHASH 61
+
+struct dentry {
+  uint dev;
+  uint dinum;           // the directory's i-number; 0 if unused
+  uint inum;            // what name refers to; 0 if nothing
+  char name[DIRSIZ];
+  struct dentry *next;  // hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry entry[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;             // the next entry to replace
+  uint64 nhit;          // lookups that found an inode
+  uint64 nneg;          // lookups that found a negative entry
+  uint64 nmiss;         // lookups that had to read the directory
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// Find the entry for name in directory dinum, and return the
+// pointer to it in its hash chain, or 0.
+// Caller must hold dcache.lock.
+static struct dentry**
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry **pp;
+
+  for(pp = dhash(dev, dinum, name); *pp; pp = &(*pp)->next)
+    if((*pp)->dev == dev && (*pp)->dinum == dinum &&
+       namecmp((*pp)->name, name) == 0)
+      return pp;
+  return 0;
+}
+
+// Look up name in directory dinum. If the cache knows it,
+// set *inum, to 0 if there's no such name, and return 1.
+// Caller must hold the directory's lock, at least shared.
+int
+dcache_lookup(uint dev, uint dinum, char *name, uint *inum)
+{
+  struct dentry **pp;
+
+  acquire(&dcache.lock);
+  if((pp = dfind(dev, dinum, name)) == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = (*pp)->inum;
+  if(*inum)
+    dcache.nhit++;
+  else
+    dcache.nneg++;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in directory dinum is i-number inum,
+// or that there's no such name if inum is 0.
+// Caller must hold the directory's lock, exclusive if the
+// directory has just changed.
+void
+dcache_enter(uint dev, uint dinum, char *name, uint inum)
+{
+  struct dentry *d, **pp;
+
+  acquire(&dcache.lock);
+  if((pp = dfind(dev, dinum, name)) != 0){
+    (*pp)->inum = inum;
+    release(&dcache.lock);
+    return;
+  }
+
+  d = &dcache.entry[dcache.hand];
+  dcache.hand = (dcache.hand + 1) % NDCACHE;
+  if(d->dinum != 0){
+    for(pp = dhash(d->dev, d->dinum, d->name); *pp != d; pp = &(*pp)->next)
+      ;
+    *pp = d->next;
+  }
+  d->dev = dev;
+  d->dinum = dinum;
+  d->inum = inum;
+  strncpy(d->name, name, DIRSIZ);
+  pp = dhash(dev, dinum, name);
+  d->next = *pp;
+  *pp = d;
+  release(&dcache.lock);
+}
+
+// Forget every entry for directory dinum, whose i-node
+// is being reused for a new directory.
+void
+dcache_purge(uint dev, uint dinum)
+{
+  struct dentry *d, **pp;
+  int i;
+
+  acquire(&dcache.lock);
+  for(i = 0; i < NDHASH; i++){
+    for(pp = &dcache.hash[i]; (d = *pp) != 0; ){
+      if(d->dev == dev && d->dinum == dinum){
+        *pp = d->next;
+        d->dinum = 0;
+      } else {
+        pp = &d->next;
+      }
+    }
+  }
+  release(&dcache.lock);
+}
+
+int
+statsdcache(char *buf, int sz)
+{
+  int n;
+
+  acquire(&dcache.lock);
+  n = snprintf(buf, sz, "dcache: #hit %d #negative %d #miss %d\n",
+               (int)dcache.nhit, (int)dcache.nneg, (int)dcache.nmiss);
+  release(&dcache.lock);
+  return n;
+}
@@ -1,6 +1,7 @@
 struct buf;
 struct context;
 struct file;
+struct iblk;
 struct inode;
 struct pipe;
 struct proc;
@@ -16,12 +17,24 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+int             bcount(void);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*);
+void            dcache_enter(uint, uint, char*, uint);
+void            dcache_purge(uint, uint);
+int             statsdcache(char*, int);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -42,6 +55,7 @@ struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilock_shared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
@@ -52,7 +66,16 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             idelaywrite(struct inode*, int, uint64, uint, uint);
+void            iflush(struct inode*);
+int             idelayed(struct inode*);
+void            iwriteback(void);
+void            writeback(void);
 void            itrunc(struct inode*);
+void            ireadahead(struct inode*, uint, uint);
+void            iblkinit(struct iblk*, struct inode*);
+int             iblkread(struct iblk*, void*, uint, uint);
+void            iblkrelse(struct iblk*);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -62,12 +85,22 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+uint64          kfreemem(void);
 void            kinit(void);
 
+// lockdep.c
+void            lockdep_init(struct spinlock*);
+void            lockdep_acquire(struct spinlock*);
+void            lockdep_release(struct spinlock*, uint64);
+int             statslockdep(char*, int);
+
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+int             log_maxop(void);
 void            end_op(void);
 
 // pipe.c
@@ -90,6 +123,9 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             setaffinity(int, int);
+int             getaffinity(int);
+int             getrusage(int, uint64);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -98,8 +134,10 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -115,12 +153,23 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             statslock(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+void            acquiresleep_shared(struct sleeplock*);
+void            releasesleep_shared(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+int             statssleeplock(char*, int);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -180,7 +229,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+int             virtio_disk_mode(int);
+int             statsdisk(char*, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,3 @@
+// modes of the virtio disk driver, set with diskmode().
+#define DISK_POLL      0x1  // waiters spin for completions before sleeping
+#define DISK_EVENTIDX  0x2  // under load, one interrupt per several completions
@@ -75,6 +75,15 @@ fileclose(struct file *f)
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
+  } else if(ff.type == FD_INODE && ff.writable && idelayed(ff.ip)){
+    // if another file delays data after this check, the
+    // writeback thread will flush it.
+    begin_opn(MAXOPBLOCKS + FLUSHBLOCKS);
+    ilock(ff.ip);
+    iflush(ff.ip);
+    iunlock(ff.ip);
+    iput(ff.ip);
+    end_opn(MAXOPBLOCKS + FLUSHBLOCKS);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
     begin_op();
     iput(ff.ip);
@@ -91,7 +100,7 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilock_shared(f->ip);
     stati(f->ip, &st);
     iunlock(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
@@ -101,6 +110,40 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// A read that starts where the last one ended is sequential,
+// and doubles f's read-ahead window up to NREADAHEAD blocks;
+// any other read closes it. Start reading the blocks this
+// read needs plus the window beyond, so that they are on their
+// way while readi() waits for the first.
+// Caller holds f->ip's lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint bn, end, nb;
+
+  if(f->off != f->raoff){
+    f->rawin = 0;
+    f->rablock = 0;
+    return;
+  }
+  if(f->rawin < NREADAHEAD)
+    f->rawin = f->rawin ? 2*f->rawin : 2;
+  if(f->rawin > NREADAHEAD)
+    f->rawin = NREADAHEAD;
+
+  nb = (n + BSIZE - 1) / BSIZE;
+  if(nb > NREADAHEAD)
+    nb = NREADAHEAD;
+  bn = f->off / BSIZE;
+  end = bn + nb + f->rawin;
+  if(bn < f->rablock)
+    bn = f->rablock;
+  if(bn < end){
+    ireadahead(f->ip, bn, end - bn);
+    f->rablock = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,9 +161,16 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
+    // the inode lock also serializes updates to f->off. if
+    // nobody else has f, readers of the inode can share it.
+    if(f->ref == 1)
+      ilock_shared(f->ip);
+    else
+      ilock(f->ip);
+    readahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->raoff = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -146,25 +196,37 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // a small append needn't touch the disk, or the log, yet.
+    ilock(f->ip);
+    if((r = idelaywrite(f->ip, 1, addr, f->off, n)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    if(r != 0)
+      return r;
+
+    // write as many blocks at a time as fit in one log
+    // transaction, counting the i-node, indirect block,
+    // allocation blocks, 2 blocks of slop for non-aligned
+    // writes, and flushing delayed appends.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((log_maxop()-1-1-2-FLUSHBLOCKS) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      int nb = 2*((n1 + BSIZE - 1) / BSIZE) + 1 + 1 + 2 + FLUSHBLOCKS;
+      if(nb < MAXOPBLOCKS)
+        nb = MAXOPBLOCKS;
 
-      begin_op();
+      begin_opn(nb);
       ilock(f->ip);
+      iflush(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nb);
 
       if(r != n1){
         // error from writei
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: offset a sequential read continues from
+  uint rablock;      // FD_INODE: blocks below this have been read ahead
+  int rawin;         // FD_INODE: read-ahead window, in blocks
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +21,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // itable hash chain
+  struct inode *lnext; // itable LRU list, if ref is 0
+  struct inode *lprev;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +32,37 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  // the last run of contiguous blocks that bmap() found:
+  // file blocks [rbn, rbn+rlen) are at [raddr, raddr+rlen).
+  struct spinlock maplock;  // readers share ip->lock
+  uint rbn;
+  uint raddr;
+  uint rlen;
+
+  // blocks [goal, rend) are reserved for the file's next
+  // allocations; see balloc().
+  uint goal;
+  uint rend;
+
+  // appended data whose blocks are not yet allocated:
+  // file bytes [doff, size) are in dbuf. see iflush().
+  char *dbuf;
+  uint doff;
+
+  // delayed.lock protects these:
+  int dlisted;        // on the delayed list?
+  uint dtime;         // ticks when dbuf was filled
+  struct inode *dnext; // delayed list
+};
+
+// a reader of an inode's data that keeps hold of the last
+// block it read; see iblkread().
+struct iblk {
+  struct inode *ip;
+  struct buf *bp;     // block bn of ip, or 0
+  uint bn;
 };
 
 // map major device number to device functions.
@@ -38,3 +74,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -37,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void freeinit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +46,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  freeinit(dev);
 }
 
 // Zero a block.
@@ -59,30 +62,168 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// Each file being written reserves a run of NPREALLOC blocks,
+// starting at a cursor that every new run moves past, and
+// allocates its blocks from the run in order. So a file
+// written sequentially is laid out contiguously, even when
+// several files are written at once. The reservation is only
+// in memory: a block is marked in the bitmap when it is
+// allocated, and a block in a run that someone else takes
+// first just ends the run early.
+
+#define NBMAP 64  // most bitmap blocks, for NBMAP*BPB blocks
+
+// The bitmap is protected by the locks of its buffers;
+// freemap.lock protects the rest.
+struct {
+  struct spinlock lock;
+  uint cursor;        // where the next run starts looking
+  int nfree[NBMAP];   // free blocks per bitmap block
+} freemap;
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Count the free blocks in each bitmap block.
+static void
+freeinit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi, end;
 
-  bp = 0;
+  initlock(&freemap.lock, "freemap");
+  if(sb.size > NBMAP*BPB)
+    panic("freeinit: too many blocks");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+    end = min(sb.size - b, BPB);
+    for(bi = 0; bi < end; bi++)
+      if((bp->data[bi/8] & (1 << (bi%8))) == 0)
+        freemap.nfree[b/BPB]++;
+    brelse(bp);
+  }
+}
+
+// Mark block b in use and zero it, if it is free.
+// Returns 0 if it is already in use.
+static int
+bclaim(int dev, uint b)
+{
+  struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  brelse(bp);
+  acquire(&freemap.lock);
+  freemap.nfree[b/BPB]--;
+  release(&freemap.lock);
+  bzero(dev, b);
+  return 1;
+}
+
+// Return the first clear bit among the n bits from bit lo
+// of a bitmap block, or -1 if there is none.
+static int
+bitscan(uchar *data, uint lo, uint n)
+{
+  uint64 w;
+  uint i, bit, hi = lo + n;
+
+  // a word at a time, skipping words with no clear bit.
+  for(i = lo; i < hi; i = (i/64 + 1) * 64){
+    w = ((uint64*)data)[i/64];
+    w |= (1L << (i%64)) - 1;  // ignore bits before i
+    if(w == ~0L)
+      continue;
+    for(bit = i%64; w & (1L << bit); bit++)
+      ;
+    i = i/64*64 + bit;
+    return i < hi ? i : -1;
+  }
+  return -1;
+}
+
+// Allocate the first free block in [lo, hi) and zero it.
+// Returns 0 if there is none.
+static uint
+bscan(int dev, uint lo, uint hi)
+{
+  struct buf *bp;
+  uint b, end;
+  int bi;
+
+  for(b = lo; b < hi; b = end){
+    end = min(hi, (b/BPB + 1) * BPB);
+    if(freemap.nfree[b/BPB] == 0)  // a hint; checked below
+      continue;
+    bp = bread(dev, BBLOCK(b, sb));
+    if((bi = bitscan(bp->data, b % BPB, end - b)) >= 0){
+      b = b/BPB*BPB + bi;
+      bp->data[bi/8] |= 1 << (bi%8);
+      log_write(bp);
+      brelse(bp);
+      acquire(&freemap.lock);
+      freemap.nfree[b/BPB]--;
+      release(&freemap.lock);
+      bzero(dev, b);
+      return b;
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Allocate a zeroed disk block for ip, preferably the
+// next one in ip's run.
+// Caller must hold ip->lock.
+static uint
+balloc(struct inode *ip)
+{
+  uint b, start;
+
+  if(ip->goal < ip->rend && ip->goal < sb.size && bclaim(ip->dev, ip->goal))
+    return ip->goal++;
+
+  // start a new run, after the runs other files have started.
+  acquire(&freemap.lock);
+  start = freemap.cursor;
+  freemap.cursor += NPREALLOC;
+  if(freemap.cursor >= sb.size)
+    freemap.cursor = 0;
+  release(&freemap.lock);
+
+  if((b = bscan(ip->dev, start, sb.size)) == 0 &&
+     (b = bscan(ip->dev, 0, start)) == 0)
+    panic("balloc: out of blocks");
+  ip->goal = b + 1;
+  ip->rend = b + NPREALLOC;
+
+  if(b != start){
+    // the cursor's run was taken; continue after this one.
+    acquire(&freemap.lock);
+    freemap.cursor = ip->rend < sb.size ? ip->rend : 0;
+    release(&freemap.lock);
+  }
+  return b;
+}
+
+// Give back the unused part of ip's run, if no run has
+// been started after it.
+// Caller must hold ip->lock, or the only reference to ip.
+static void
+bunreserve(struct inode *ip)
+{
+  acquire(&freemap.lock);
+  if(ip->goal < ip->rend && freemap.cursor == (ip->rend < sb.size ? ip->rend : 0))
+    freemap.cursor = ip->goal;
+  release(&freemap.lock);
+  ip->rend = ip->goal;
 }
 
 // Free a disk block.
@@ -100,6 +241,9 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  acquire(&freemap.lock);
+  freemap.nfree[b/BPB]++;
+  release(&freemap.lock);
 }
 
 // Inodes.
@@ -127,22 +271,26 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero stays in the table, on an
+//   LRU list, in case it's wanted again; iget() recycles
+//   the least recently used one once the table has NINODE
+//   entries, and makes more if they are all in use.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode.
+//   has first locked the inode. Code that only examines
+//   them (readi, dirlookup, stati) may use ilock_shared(),
+//   which lets other readers in at the same time.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -163,55 +311,172 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries, its hash table and LRU list. Since ip->ref indicates
+// whether an entry is free, and ip->dev and ip->inum indicate
+// which i-node an entry holds, one must hold itable.lock while
+// using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+// Holding it shared allows reading those fields, but not writing.
+
+#define NIHASH 61
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // entries by (dev, inum)
+  struct inode lru;  // entries with ref 0; lru.lnext is the most recent
+  int n;             // entries made so far
+  uint icursor;      // where ialloc() starts looking
 } itable;
 
+// inodes with delayed data, oldest first; see idelaywrite().
+struct {
+  struct spinlock lock;
+  struct inode *head;
+  struct inode *tail;
+} delayed;
+
+static void delayed_remove(struct inode*);
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&delayed.lock, "delayed");
+  if(NDELAY*BSIZE > PGSIZE)
+    panic("iinit: NDELAY");
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  itable.icursor = 1;
+}
+
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &itable.hash[(dev * 31 + inum) % NIHASH];
+}
+
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+}
+
+static void
+lru_push(struct inode *ip)
+{
+  ip->lnext = itable.lru.lnext;
+  ip->lprev = &itable.lru;
+  itable.lru.lnext->lprev = ip;
+  itable.lru.lnext = ip;
+}
+
+// Add a page's worth of new entries to the LRU end of the
+// LRU list, so they are used first.
+// Caller must hold itable.lock.
+static void
+igrow(void)
+{
+  struct inode *ip;
+  char *p;
+  int i;
+
+  if((p = kalloc()) == 0)
+    panic("iget: no inodes");
+  memset(p, 0, PGSIZE);
+  for(i = 0; i < PGSIZE / sizeof(struct inode); i++){
+    ip = (struct inode*)p + i;
+    initsleeplock(&ip->lock, "inode");
+    initlock(&ip->maplock, "imap");
+    ip->lnext = &itable.lru;  // inum 0: not in the hash table
+    ip->lprev = itable.lru.lprev;
+    itable.lru.lprev->lnext = ip;
+    itable.lru.lprev = ip;
+    itable.n++;
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Mark the first free inode in [lo, hi) allocated in the
+// free-inode map. Returns its number, or 0 if there is none.
+static uint
+iscan(uint dev, uint lo, uint hi)
+{
+  struct buf *bp;
+  uint inum, end;
+  int bi;
+
+  for(inum = lo; inum < hi; inum = end){
+    end = min(hi, (inum/BPB + 1) * BPB);
+    bp = bread(dev, IBBLOCK(inum, sb));
+    if((bi = bitscan(bp->data, inum % BPB, end - inum)) >= 0){
+      inum = inum/BPB*BPB + bi;
+      bp->data[bi/8] |= 1 << (bi%8);
+      log_write(bp);
+      brelse(bp);
+      return inum;
+    }
+    brelse(bp);
+  }
+  return 0;
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum, start;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
-  }
-  panic("ialloc: no inodes");
+  acquire(&itable.lock);
+  start = itable.icursor;
+  release(&itable.lock);
+
+  if((inum = iscan(dev, start, sb.ninodes)) == 0 &&
+     (inum = iscan(dev, 1, start)) == 0)
+    panic("ialloc: no inodes");
+
+  acquire(&itable.lock);
+  itable.icursor = inum + 1;
+  release(&itable.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// Mark inode inum free in the free-inode map.
+static void
+ifree(uint dev, uint inum)
+{
+  struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, IBBLOCK(inum, sb));
+  bi = inum % BPB;
+  m = 1 << (bi % 8);
+  if((bp->data[bi/8] & m) == 0)
+    panic("freeing free inode");
+  bp->data[bi/8] &= ~m;
+  log_write(bp);
+  brelse(bp);
+
+  acquire(&itable.lock);
+  if(inum < itable.icursor)
+    itable.icursor = inum;
+  release(&itable.lock);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -230,7 +495,8 @@ iupdate(struct inode *ip)
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
+  // delayed data isn't on disk yet.
+  dip->size = ip->dbuf ? ip->doff : ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
@@ -242,31 +508,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = *ihash(dev, inum); ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lru_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Recycle the least recently used entry, or make more
+  // if there are fewer than NINODE or none is free.
+  ip = itable.lru.lprev;
+  if(ip == &itable.lru || (ip->inum != 0 && itable.n < NINODE)){
+    igrow();
+    ip = itable.lru.lprev;
+  }
+  lru_remove(ip);
+  if(ip->inum != 0){
+    for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  pp = ihash(dev, inum);
+  ip->hnext = *pp;
+  *pp = ip;
   release(&itable.lock);
 
   return ip;
@@ -306,20 +582,45 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->rlen = 0;
+    ip->goal = ip->rend = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
-// Unlock the given inode.
+// Lock the given inode shared, for reading only.
+// Reads the inode from disk if necessary.
+void
+ilock_shared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilock_shared");
+
+  // load the inode under the exclusive lock. ip->valid is
+  // only cleared by iput() of the last reference, and we
+  // hold a reference, so it stays set.
+  if(ip->valid == 0){
+    ilock(ip);
+    iunlock(ip);
+  }
+
+  acquiresleep_shared(&ip->lock);
+}
+
+// Unlock the given inode, locked by either
+// ilock() or ilock_shared().
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  if(holdingsleep(&ip->lock))
+    releasesleep(&ip->lock);
+  else
+    releasesleep_shared(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -346,14 +647,19 @@ iput(struct inode *ip)
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    ifree(ip->dev, ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
+  } else if(ip->ref == 1 && ip->valid){
+    // no one is writing ip any more.
+    bunreserve(ip);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    lru_push(ip);
   release(&itable.lock);
 }
 
@@ -370,19 +676,41 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT after
+// that are listed in the indirect blocks listed in the
+// doubly-indirect block ip->addrs[NDIRECT+1].
+//
+// Files are mostly written sequentially into contiguous
+// blocks, so bmap() remembers the run of contiguous blocks
+// that ends with its last lookup; a lookup inside that run
+// needs no indirect blocks.
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Return entry i of indirect block addr, allocating
+// a block for it if there is none.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapind(struct inode *ip, uint addr, uint i)
 {
-  uint addr, *a;
+  uint *a;
   struct buf *bp;
 
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = balloc(ip);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+static uint
+bmap1(struct inode *ip, uint bn)
+{
+  uint addr;
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,28 +718,118 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = balloc(ip);
+    return bmapind(ip, addr, bn);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the doubly-indirect block, then the indirect block.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip);
+    addr = bmapind(ip, addr, bn / NINDIRECT);
+    return bmapind(ip, addr, bn % NINDIRECT);
   }
 
   panic("bmap: out of range");
 }
 
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  uint addr;
+
+  // the run only covers allocated blocks, which don't move
+  // until itrunc(), so a hit is safe under a shared ip->lock.
+  acquire(&ip->maplock);
+  if(bn - ip->rbn < ip->rlen){  // unsigned: false if bn < rbn
+    addr = ip->raddr + (bn - ip->rbn);
+    release(&ip->maplock);
+    return addr;
+  }
+  release(&ip->maplock);
+
+  addr = bmap1(ip, bn);
+
+  acquire(&ip->maplock);
+  if(ip->rlen > 0 && bn == ip->rbn + ip->rlen && addr == ip->raddr + ip->rlen){
+    ip->rlen++;
+  } else {
+    ip->rbn = bn;
+    ip->raddr = addr;
+    ip->rlen = 1;
+  }
+  release(&ip->maplock);
+  return addr;
+}
+
+// Start reading blocks [bn, bn+n) of ip into the buffer
+// cache, without waiting. Blocks past the end of the file
+// are skipped, so bmap() never allocates.
+// Caller must hold ip->lock, shared or exclusive.
+void
+ireadahead(struct inode *ip, uint bn, uint n)
+{
+  uint size = ip->dbuf ? ip->doff : ip->size;
+  uint end = (size + BSIZE - 1) / BSIZE;
+
+  if(bn + n < end)
+    end = bn + n;
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
+// Free indirect block addr and the blocks it lists, which
+// are themselves indirect blocks if depth > 1.
+static void
+itruncind(struct inode *ip, uint addr, int depth)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  // start reading what bfree or the next level will need
+  // together, rather than one at a time.
+  for(j = 0; j < NINDIRECT; j++)
+    if(a[j])
+      breadahead(ip->dev, depth > 1 ? a[j] : BBLOCK(a[j], sb));
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      itruncind(ip, a[j], depth - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->dbuf){
+    kfree(ip->dbuf);
+    ip->dbuf = 0;
+    delayed_remove(ip);
+  }
+
+  // start reading the indirect blocks and the bitmap blocks
+  // together, rather than one at a time as bfree needs them.
+  for(i = NDIRECT; i < NDIRECT+2; i++)
+    if(ip->addrs[i])
+      breadahead(ip->dev, ip->addrs[i]);
+  for(i = 0; i < NDIRECT; i++)
+    if(ip->addrs[i])
+      breadahead(ip->dev, BBLOCK(ip->addrs[i], sb));
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -421,17 +839,18 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
+  bunreserve(ip);
+  ip->goal = ip->rend = 0;
+  ip->rlen = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -449,7 +868,10 @@ stati(struct inode *ip, struct stat *st)
 }
 
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared: blocks
+// below ip->size are always allocated, apart from delayed
+// appends in ip->dbuf, so the bmap() calls here never
+// allocate.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
@@ -464,8 +886,19 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(ip->dbuf && off >= ip->doff){
+      // appended data that iflush() hasn't written yet.
+      m = n - tot;
+      if(either_copyout(user_dst, dst, ip->dbuf + (off - ip->doff), m) == -1)
+        tot = -1;
+      else
+        tot += m;
+      break;
+    }
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->dbuf && off + m > ip->doff)
+      m = ip->doff - off;
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -476,6 +909,68 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Block iterators.
+//
+// A loop that reads an inode a few bytes at a time, like a
+// directory scan, would bread() and brelse() each block once
+// per read through readi(). iblkread() instead keeps the last
+// block it read locked until a read moves off it or the
+// caller calls iblkrelse(); so the caller mustn't touch that
+// block any other way, with readi() or writei(), meanwhile.
+
+void
+iblkinit(struct iblk *it, struct inode *ip)
+{
+  it->ip = ip;
+  it->bp = 0;
+}
+
+// Read n bytes at off from it->ip into kernel memory at dst,
+// as readi(it->ip, 0, dst, off, n) would.
+// Caller must hold it->ip->lock, perhaps shared, until
+// iblkrelse().
+int
+iblkread(struct iblk *it, void *dst, uint off, uint n)
+{
+  struct inode *ip = it->ip;
+  char *p = dst;
+  uint tot, m, bn;
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0; tot<n; tot+=m, off+=m, p+=m){
+    if(ip->dbuf && off >= ip->doff){
+      m = n - tot;
+      memmove(p, ip->dbuf + (off - ip->doff), m);
+      continue;
+    }
+    bn = off/BSIZE;
+    if(it->bp == 0 || it->bn != bn){
+      iblkrelse(it);
+      it->bp = bread(ip->dev, bmap(ip, bn));
+      it->bn = bn;
+    }
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->dbuf && off + m > ip->doff)
+      m = ip->doff - off;
+    memmove(p, it->bp->data + (off % BSIZE), m);
+  }
+  return tot;
+}
+
+// Release the block iblkread() last read, if any.
+void
+iblkrelse(struct iblk *it)
+{
+  if(it->bp){
+    brelse(it->bp);
+    it->bp = 0;
+  }
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -516,6 +1011,164 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Delayed allocation.
+//
+// Small appends to a file are copied to ip->dbuf, without
+// allocating blocks or logging anything, until NDELAY blocks'
+// worth have built up, the file is closed, or the writeback
+// thread finds them WBTICKS old; iflush() then allocates their
+// blocks together. The on-disk inode's size stays at ip->doff
+// until then, so after a crash it never covers unwritten
+// blocks.
+//
+// An inode with delayed data is on the delayed list, oldest
+// first, which holds a reference to it; so the last iput()
+// of an inode never finds delayed data.
+
+// Put ip, whose dbuf has just been filled, on the delayed list.
+static void
+delayed_add(struct inode *ip)
+{
+  idup(ip);
+  acquire(&delayed.lock);
+  ip->dlisted = 1;
+  ip->dtime = ticks;
+  ip->dnext = 0;
+  if(delayed.tail)
+    delayed.tail->dnext = ip;
+  else
+    delayed.head = ip;
+  delayed.tail = ip;
+  release(&delayed.lock);
+}
+
+// Take ip, whose dbuf has just been emptied, off the delayed
+// list, and drop the list's reference. The caller must hold
+// another.
+static void
+delayed_remove(struct inode *ip)
+{
+  struct inode *prev, *p;
+
+  acquire(&delayed.lock);
+  prev = 0;
+  for(p = delayed.head; p != ip; p = p->dnext)
+    prev = p;
+  if(prev)
+    prev->dnext = ip->dnext;
+  else
+    delayed.head = ip->dnext;
+  if(delayed.tail == ip)
+    delayed.tail = prev;
+  ip->dlisted = 0;
+  release(&delayed.lock);
+
+  acquire(&itable.lock);
+  if(ip->ref < 2)
+    panic("delayed_remove");
+  ip->ref--;
+  release(&itable.lock);
+}
+
+// Does ip have delayed data? The answer may be out of date
+// by the time the caller looks, unless it holds ip->lock.
+int
+idelayed(struct inode *ip)
+{
+  int r;
+
+  acquire(&delayed.lock);
+  r = ip->dlisted;
+  release(&delayed.lock);
+  return r;
+}
+
+// Append n bytes at off to ip's delayed data, if off is the
+// end of the file and they fit. Returns n, 0 if the caller
+// must use writei() instead, or -1 on a copy error.
+// Caller must hold ip->lock but needn't be in a transaction.
+int
+idelaywrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  if(ip->type != T_FILE || off != ip->size || n == 0 || n >= NDELAY*BSIZE)
+    return 0;
+  if(off + n < off || off + n > MAXFILE*BSIZE)
+    return 0;
+  if(ip->dbuf == 0){
+    if((ip->dbuf = kalloc()) == 0)
+      return 0;
+    ip->doff = off;
+    delayed_add(ip);
+  }
+  if(off + n > ip->doff + NDELAY*BSIZE)
+    return 0;  // full; the caller's transaction will flush it
+  if(either_copyin(ip->dbuf + (off - ip->doff), user_src, src, n) == -1)
+    return -1;
+  ip->size = off + n;
+  return n;
+}
+
+// Write ip's delayed data to disk.
+// Caller must hold ip->lock and be in a transaction with
+// FLUSHBLOCKS log blocks to spare.
+void
+iflush(struct inode *ip)
+{
+  char *p = ip->dbuf;
+  uint n = ip->size - ip->doff;
+
+  if(p == 0)
+    return;
+  ip->dbuf = 0;
+  ip->size = ip->doff;
+  if(writei(ip, 0, (uint64)p, ip->doff, n) != n)
+    panic("iflush");
+  kfree(p);
+  delayed_remove(ip);
+}
+
+// Flush the delayed data that has waited WBTICKS or more.
+void
+iwriteback(void)
+{
+  struct inode *ip;
+
+  while(1){
+    acquire(&delayed.lock);
+    ip = delayed.head;
+    if(ip == 0 || ticks - ip->dtime < WBTICKS){
+      release(&delayed.lock);
+      return;
+    }
+    idup(ip);
+    release(&delayed.lock);
+
+    begin_opn(MAXOPBLOCKS + FLUSHBLOCKS);
+    ilock(ip);
+    iflush(ip);
+    iunlock(ip);
+    iput(ip);
+    end_opn(MAXOPBLOCKS + FLUSHBLOCKS);
+  }
+}
+
+// The writeback thread, which bounds how long appends stay
+// in memory, and so how many a crash can lose.
+void
+writeback(void)
+{
+  uint ticks0;
+
+  while(1){
+    iwriteback();
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < WBTICKS/2)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
 // Directories
 
 int
@@ -524,32 +1177,299 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories; see fs.h for their layout.
+
+// The hash of a directory entry name. mkfs has a copy.
+static uint
+dirhashname(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Table entry i in the first block of a hashed directory.
+static ushort*
+dirtab(uchar *data, uint i)
+{
+  return (ushort*)(data + (DIRTAB + i/DIRTPS) * sizeof(struct dirent) +
+                   sizeof(ushort) + (i%DIRTPS) * sizeof(ushort));
+}
+
+// If dp is a hashed directory, return its first block, locked.
+static struct buf*
+dirhead(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirhash *h;
+
+  if(dp->size < 2*BSIZE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  h = (struct dirhash*)bp->data + 2;
+  if(h->inum == 0 && h->magic == DIRMAGIC)
+    return bp;
+  brelse(bp);
+  return 0;
+}
+
+// Read block fbn of hashed directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint fbn)
+{
+  // a bad block number mustn't make bmap() allocate.
+  if(fbn == 0 || fbn >= dp->size / BSIZE)
+    panic("dirblock");
+  return bread(dp->dev, bmap(dp, fbn));
+}
+
+// Add a zeroed block to the end of directory dp. Returns its
+// block number within dp, or 0 if a table can't refer to it.
+// Caller must hold dp->lock exclusive.
+static uint
+dirgrow(struct inode *dp)
+{
+  struct buf *bp;
+  uint fbn = dp->size / BSIZE;
+
+  if(fbn > 0xffff || fbn >= MAXFILE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, fbn));
+  memset(bp->data, 0, BSIZE);
+  log_write(bp);
+  brelse(bp);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return fbn;
+}
+
+// Look for name in hashed directory dp, whose first block hb
+// it releases. Returns its i-number and sets *poff, or returns 0.
+static uint
+hdirlookup(struct inode *dp, struct buf *hb, char *name, uint *poff)
+{
+  struct dirhash *h = (struct dirhash*)hb->data + 2;
+  struct dirent *de = (struct dirent*)hb->data;
+  struct buf *bp;
+  uint fbn, inum;
+  int i;
+
+  for(i = 0; i < 2; i++){  // "." and ".."
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      inum = de[i].inum;
+      *poff = i * sizeof(*de);
+      brelse(hb);
+      return inum;
+    }
+  }
+  fbn = *dirtab(hb->data, dirhashname(name) & ((1 << h->depth) - 1));
+  brelse(hb);
+
+  // the bucket, then its overflow blocks.
+  while(fbn != 0){
+    bp = dirblock(dp, fbn);
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        inum = de[i].inum;
+        *poff = fbn * BSIZE + i * sizeof(*de);
+        brelse(bp);
+        return inum;
+      }
+    }
+    fbn = ((struct dirbucket*)bp->data)->next;
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Split the full bucket bp, block fbn of hashed directory dp,
+// in two, doubling the table in dp's first block hb if need be.
+// Returns -1 if dp can't grow.
+static int
+dirsplit(struct inode *dp, struct buf *hb, struct buf *bp, uint fbn)
+{
+  struct dirhash *h = (struct dirhash*)hb->data + 2;
+  struct dirbucket *b = (struct dirbucket*)bp->data;
+  struct dirent *de = (struct dirent*)bp->data, *nde;
+  struct buf *nbp;
+  uint nfbn, bit, i, j;
+
+  if((nfbn = dirgrow(dp)) == 0)
+    return -1;
+  if(b->depth == h->depth){
+    for(i = 0; i < (1 << h->depth); i++)
+      *dirtab(hb->data, i + (1 << h->depth)) = *dirtab(hb->data, i);
+    h->depth++;
+  }
+
+  // move the names with the next bit of hash set to a new
+  // bucket, and point the table entries with it set there.
+  bit = 1 << b->depth;
+  nbp = dirblock(dp, nfbn);
+  nde = (struct dirent*)nbp->data;
+  for(i = j = 1; i < DPB; i++){
+    if(dirhashname(de[i].name) & bit){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  b->depth++;
+  ((struct dirbucket*)nbp->data)->depth = b->depth;
+  for(i = 0; i < (1 << h->depth); i++)
+    if(*dirtab(hb->data, i) == fbn && (i & bit))
+      *dirtab(hb->data, i) = nfbn;
+
+  log_write(nbp);
+  brelse(nbp);
+  log_write(bp);
+  log_write(hb);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp, whose first block
+// hb it releases. Returns -1 if dp can't grow.
+static int
+hdirlink(struct inode *dp, struct buf *hb, char *name, uint inum)
+{
+  struct dirhash *h = (struct dirhash*)hb->data + 2;
+  struct dirbucket *b;
+  struct dirent *de;
+  struct buf *bp, *nbp;
+  uint hash = dirhashname(name), fbn;
+  int i, split = 0;
+
+  for(;;){
+    fbn = *dirtab(hb->data, hash & ((1 << h->depth) - 1));
+    bp = dirblock(dp, fbn);
+    b = (struct dirbucket*)bp->data;
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++)
+      if(de[i].inum == 0)
+        break;
+    // split a full bucket once, if it has no overflow blocks.
+    if(i < DPB || split || b->next != 0 || b->depth == DIRMAXDEPTH)
+      break;
+    if(dirsplit(dp, hb, bp, fbn) < 0){
+      brelse(bp);
+      brelse(hb);
+      return -1;
+    }
+    brelse(bp);
+    split = 1;
+  }
+
+  // find a free slot in the bucket or its overflow blocks,
+  // adding one if they're full.
+  while(i == DPB){
+    b = (struct dirbucket*)bp->data;
+    if(b->next == 0){
+      if((fbn = dirgrow(dp)) == 0){
+        brelse(bp);
+        brelse(hb);
+        return -1;
+      }
+      b->next = fbn;
+      log_write(bp);
+    }
+    nbp = dirblock(dp, b->next);
+    brelse(bp);
+    bp = nbp;
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++)
+      if(de[i].inum == 0)
+        break;
+  }
+
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  brelse(hb);
+  return 0;
+}
+
+// Turn the linear directory dp, whose first and only block is
+// full, into a hashed directory with one bucket.
+// Returns -1 if it can't.
+static int
+dirconvert(struct inode *dp)
+{
+  struct buf *hb, *bp;
+  struct dirent *de, *bde;
+  int i;
+
+  if(dp->size != BSIZE)
+    return -1;
+  hb = bread(dp->dev, bmap(dp, 0));
+  de = (struct dirent*)hb->data;
+  if(namecmp(de[0].name, ".") != 0 || namecmp(de[1].name, "..") != 0 ||
+     dirgrow(dp) != 1){
+    brelse(hb);
+    return -1;
+  }
+  bp = dirblock(dp, 1);
+  bde = (struct dirent*)bp->data;
+  for(i = 2; i < DPB; i++){
+    bde[i-1] = de[i];
+    memset(&de[i], 0, sizeof(de[i]));
+  }
+  ((struct dirhash*)hb->data + 2)->magic = DIRMAGIC;
+  *dirtab(hb->data, 0) = 1;
+  log_write(bp);
+  brelse(bp);
+  log_write(hb);
+  brelse(hb);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Only a caller that doesn't want the offset can be
+// answered from the directory entry cache.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct buf *hb;
+  struct iblk it;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(poff == 0 && dcache_lookup(dp->dev, dp->inum, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  inum = 0;
+  off = 0;
+  if((hb = dirhead(dp)) != 0){
+    inum = hdirlookup(dp, hb, name, &off);
+  } else {
+    iblkinit(&it, dp);
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(iblkread(&it, &de, off, sizeof(de)) != sizeof(de))
+        panic("dirlookup read");
+      if(de.inum == 0)
+        continue;
+      if(namecmp(name, de.name) == 0){
+        // entry matches path element
+        inum = de.inum;
+        break;
+      }
     }
+    iblkrelse(&it);
   }
 
-  return 0;
+  dcache_enter(dp->dev, dp->inum, name, inum);
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -559,6 +1479,8 @@ dirlink(struct inode *dp, char *name, uint inum)
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *hb;
+  struct iblk it;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -566,18 +1488,36 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if((hb = dirhead(dp)) != 0){
+    if(hdirlink(dp, hb, name, inum) < 0)
+      return -1;
+    dcache_enter(dp->dev, dp->inum, name, inum);
+    return 0;
+  }
+
   // Look for an empty dirent.
+  iblkinit(&it, dp);
   for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    if(iblkread(&it, &de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
       break;
   }
+  iblkrelse(&it);
+
+  // rather than grow a full block into a second, hash it.
+  if(off == BSIZE && dirconvert(dp) == 0){
+    if(hdirlink(dp, dirhead(dp), name, inum) < 0)
+      return -1;
+    dcache_enter(dp->dev, dp->inum, name, inum);
+    return 0;
+  }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_enter(dp->dev, dp->inum, name, inum);
 
   return 0;
 }
@@ -636,7 +1576,7 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilock_shared(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
       return 0;
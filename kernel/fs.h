@@ -7,7 +7,7 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                    free inode map | free bit map | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,13 +20,19 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint imapstart;    // Block number of first free-inode map block
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// most blocks in each half of the log, so that its header fits
+// in one block.
+#define MAXLOG ((BSIZE - 3*sizeof(uint)) / sizeof(uint))
+
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +41,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -50,6 +56,9 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Block of free-inode map containing bit for inode i
+#define IBBLOCK(i, sb) ((i)/BPB + sb.imapstart)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -58,3 +67,34 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory whose first block fills up becomes a hash table.
+// Its first block keeps "." and "..", followed by a struct dirhash
+// and the table: 1<<depth block numbers (within the directory) of
+// buckets, DIRTPS to a dirent-sized slot from slot DIRTAB, indexed
+// by the low bits of dirhashname(). Each other block is a bucket,
+// a struct dirbucket and then DPB-1 dirents; a full bucket is
+// split, or if it can't be, given an overflow block.
+// These all have inum 0, like free dirents, so a program that
+// reads a directory as dirents (ls) sees only the names in it.
+#define DIRMAGIC 0x52494448   // "HDIR"
+#define DIRMAXDEPTH 8
+#define DIRTAB 3              // first slot of the table
+#define DIRTPS ((sizeof(struct dirent) - sizeof(ushort)) / sizeof(ushort))
+
+struct dirhash {   // slot 2 of the first block
+  ushort inum;     // 0
+  ushort depth;    // the table has 1<<depth entries
+  uint magic;      // DIRMAGIC
+  uint pad[2];
+};
+
+struct dirbucket { // slot 0 of each bucket block
+  ushort inum;     // 0
+  ushort depth;    // the low depth bits of its names' hashes agree
+  uint next;       // overflow block, or 0
+  uint pad[2];
+};
+
@@ -0,0 +1,210 @@
+//
+// lock dependency validator and hold-time profiler,
+// built only with make LOCKDEP=1.
+//
+// locks with the same name form a class. acquire() records an
+// edge from each class this CPU already holds to the class
+// being acquired. a new edge that closes a cycle means two
+// code paths take the same locks in opposite orders, which
+// can deadlock; it is reported once, on the console and
+// through the statistics device. release() records the
+// longest and total hold time of each class.
+//
+// sleep locks are not tracked, since they are held across
+// sleep() and may be released on another CPU.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NCLASS   64  // lock classes; one bit each in edges[]
+#define NHELD    16  // locks one CPU can hold at once
+#define NREPORT  16  // order inversions kept for statslockdep()
+
+static char *classname[NCLASS];
+static int nclass;  // written with lock_locks held (see initlock())
+
+// edges[a] has bit b set if class b has been acquired
+// while holding class a. only ever gains bits.
+static uint64 edges[NCLASS];
+
+// order inversions found so far.
+static struct {
+  int held, acq;
+} report[NREPORT];
+static int nreport;
+
+// per-CPU state; interrupts are off whenever it's used.
+static struct {
+  int n;
+  struct spinlock *held[NHELD];  // locks held, in acquisition order
+  int busy;                      // inside lockdep; don't recurse
+  int npend;                     // reports not printed yet
+  int pend[NREPORT];
+} ldcpu[NCPU];
+
+// hold times per class, per CPU to avoid atomics.
+static struct {
+  uint64 n;
+  uint64 total;
+  uint64 max;
+} ldhold[NCPU][NCLASS];
+
+// Give lk the class for its name.
+// Called by initlock() with lock_locks held.
+void
+lockdep_init(struct spinlock *lk)
+{
+  int i;
+
+  for(i = 0; i < nclass; i++)
+    if(strncmp(classname[i], lk->name, 32) == 0)
+      break;
+  if(i == nclass){
+    if(nclass == NCLASS){
+      lk->ldclass = 0;  // out of classes; don't track.
+      return;
+    }
+    classname[nclass++] = lk->name;
+  }
+  lk->ldclass = i + 1;
+}
+
+// Is class to reachable from class from in the order graph?
+static int
+reachable(int from, int to)
+{
+  uint64 seen = 0, frontier = 1L << from, next;
+  int i;
+
+  while(frontier){
+    if(frontier & (1L << to))
+      return 1;
+    seen |= frontier;
+    next = 0;
+    for(i = 0; i < NCLASS; i++)
+      if(frontier & (1L << i))
+        next |= edges[i];
+    frontier = next & ~seen;
+  }
+  return 0;
+}
+
+// Called by acquire() before it waits for lk.
+void
+lockdep_acquire(struct spinlock *lk)
+{
+  int id = cpuid();
+  int a, b, i, r;
+
+  if(ldcpu[id].busy)
+    return;
+  ldcpu[id].busy = 1;
+
+  b = lk->ldclass - 1;
+  for(i = 0; b >= 0 && i < ldcpu[id].n; i++){
+    a = ldcpu[id].held[i]->ldclass - 1;
+    if(a < 0 || a == b || (edges[a] & (1L << b)))
+      continue;
+    if(reachable(b, a)){
+      r = __sync_fetch_and_add(&nreport, 1);
+      if(r < NREPORT){
+        report[r].held = a;
+        report[r].acq = b;
+        if(ldcpu[id].npend < NREPORT)
+          ldcpu[id].pend[ldcpu[id].npend++] = r;
+      }
+    }
+    __sync_fetch_and_or(&edges[a], 1L << b);
+  }
+
+  if(ldcpu[id].n < NHELD)
+    ldcpu[id].held[ldcpu[id].n++] = lk;
+  ldcpu[id].busy = 0;
+}
+
+// Called by release() with the time lk was held.
+void
+lockdep_release(struct spinlock *lk, uint64 t)
+{
+  int id = cpuid();
+  int b, i, r;
+
+  if(ldcpu[id].busy)
+    return;
+
+  for(i = ldcpu[id].n - 1; i >= 0; i--){
+    if(ldcpu[id].held[i] == lk){
+      for(; i < ldcpu[id].n - 1; i++)
+        ldcpu[id].held[i] = ldcpu[id].held[i+1];
+      ldcpu[id].n--;
+      break;
+    }
+  }
+
+  if((b = lk->ldclass - 1) >= 0){
+    ldhold[id][b].n++;
+    ldhold[id][b].total += t;
+    if(t > ldhold[id][b].max)
+      ldhold[id][b].max = t;
+  }
+
+  // printf() takes a lock, so only report once
+  // this CPU holds none.
+  if(ldcpu[id].n == 0 && ldcpu[id].npend > 0){
+    ldcpu[id].busy = 1;
+    for(i = 0; i < ldcpu[id].npend; i++){
+      r = ldcpu[id].pend[i];
+      printf("lockdep: %s acquired while holding %s, the reverse of an earlier order\n",
+             classname[report[r].acq], classname[report[r].held]);
+    }
+    ldcpu[id].npend = 0;
+    ldcpu[id].busy = 0;
+  }
+}
+
+// Print order inversions and the classes with the longest
+// hold times into buf. Returns the number of bytes written.
+int
+statslockdep(char *buf, int sz)
+{
+  uint64 n[NCLASS], total[NCLASS], max[NCLASS];
+  int done[NCLASS];
+  int i, j, k, best, off;
+
+  off = 0;
+  for(i = 0; i < nreport && i < NREPORT; i++)
+    off += snprintf(buf+off, sz-off, "lockdep: order inversion: %s then %s\n",
+                    classname[report[i].held], classname[report[i].acq]);
+
+  for(j = 0; j < nclass; j++){
+    n[j] = total[j] = max[j] = 0;
+    done[j] = 0;
+    for(i = 0; i < NCPU; i++){
+      n[j] += ldhold[i][j].n;
+      total[j] += ldhold[i][j].total;
+      if(ldhold[i][j].max > max[j])
+        max[j] = ldhold[i][j].max;
+    }
+  }
+
+  // the ten classes with the longest single hold.
+  for(k = 0; k < 10; k++){
+    best = -1;
+    for(j = 0; j < nclass; j++)
+      if(!done[j] && n[j] > 0 && (best < 0 || max[j] > max[best]))
+        best = j;
+    if(best < 0)
+      break;
+    done[best] = 1;
+    off += snprintf(buf+off, sz-off, "lockdep: %s: #held %d max %d avg %d\n",
+                    classname[best], (int)n[best], (int)max[best],
+                    (int)(total[best] / n[best]));
+  }
+  return off;
+}
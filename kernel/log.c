@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only commits a transaction when
+// none of its FS system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -20,31 +20,82 @@
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// begin_op() reserves log space for MAXOPBLOCKS blocks;
+// a call that writes more uses begin_opn()/end_opn().
+//
+// Transactions are double-buffered: once a committing
+// transaction's blocks have been copied into the log, a new
+// transaction opens and accumulates system calls while the
+// old one is written to disk. The on-disk log has a half for
+// each, used alternately, so each half holds one of the last
+// two committed transactions. Recovery replays both, older
+// first.
+//
+// A commit writes the header and the logged blocks all at
+// once. The header holds a checksum of itself and the blocks,
+// and recovery ignores a half whose checksum doesn't match,
+// so a crash part-way through leaves the transaction
+// uncommitted. Once committed, the transaction's blocks are
+// written to their home locations in the background. A half
+// is not overwritten until the transaction in it has been
+// installed, except for blocks the following transaction
+// also modified, which that transaction's half covers.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
+// The on-disk format of each half of the log:
 //   header block, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous: commit() starts the writes of all
+// of a transaction's blocks and its header, and then waits for
+// all of them.
+
+// how long the last system call of a transaction waits for
+// others to join it before committing, in cycles of the time
+// CSR (10 MHz under qemu). only used once transactions have
+// been seen to hold several system calls.
+#define GCWINDOW 2000
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;   // which transaction; orders the halves for recovery
+  uint cksum; // of the header and the logged blocks
+  int block[MAXLOG];
 };
 
+// buckets in the hash of the open transaction's block numbers.
+#define NLOGHASH 64
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // data blocks in each half of the log
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still write.
+  int committing;  // a commit() is in progress.
+  int copying;     // commit() is copying blocks to the log; please wait.
+  int nops;        // sys calls that have joined the open transaction.
+  int lastops;     // and the last committed one.
   int dev;
-  struct logheader lh;
+  uint seq;        // seq of the open transaction
+  struct logheader lh;  // the open transaction
+  struct logheader clh; // the committing one
+  int ninstall[2]; // installs still being written, per half
+
+  // lh.block[] indices, chained by block number hash, so that
+  // log_write() finds a block already in the transaction quickly.
+  short hhead[NLOGHASH];
+  short hnext[MAXLOG];
+
+  // buffers held by commit or recovery, which only one
+  // process at a time does. too big for the stack.
+  struct buf *lbuf[MAXLOG];
+  struct buf *dbuf[MAXLOG];
 };
 struct log log;
 
@@ -54,61 +105,208 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.cap = log.size/2 - 1;
+  if(log.cap > MAXLOG)
+    log.cap = MAXLOG;
+  if(log.cap < MAXOPBLOCKS + FLUSHBLOCKS)
+    panic("initlog: log too small");
   recover_from_log();
+
+  // a commit holds its log and home blocks, while the open
+  // transaction and the other half's installs pin theirs, so
+  // leave the buffer cache the share NBUF leaves LOGSIZE.
+  if(log.cap > bcount() / (NBUF/LOGSIZE))
+    log.cap = bcount() / (NBUF/LOGSIZE);
+  if(log.cap < MAXOPBLOCKS + FLUSHBLOCKS)
+    panic("initlog: too few buffers");
+}
+
+// Where block number b is in the open transaction, or -1.
+static int
+lookup(uint b)
+{
+  int i;
+
+  for(i = log.hhead[b % NLOGHASH]; i >= 0; i = log.hnext[i])
+    if(log.lh.block[i] == b)
+      return i;
+  return -1;
+}
+
+// Empty the open transaction's hash.
+static void
+clearhash(void)
+{
+  memset(log.hhead, 0xff, sizeof(log.hhead));  // all -1
+}
+
+// The block number of the header of half h of the log.
+static int
+loghead(int h)
+{
+  return log.start + h*(log.size/2);
+}
+
+// A transaction's checksum folds in the header fields, and
+// then each logged block (FNV-1a over 32-bit words).
+static uint
+cksum(uint sum, uint *p, int n)
+{
+  for (int i = 0; i < n; i++)
+    sum = (sum ^ p[i]) * 16777619;
+  return sum;
+}
+
+static uint
+cksum_head(struct logheader *lh)
+{
+  uint sum = cksum(2166136261, (uint*)&lh->n, 1);
+  sum = cksum(sum, &lh->seq, 1);
+  return cksum(sum, (uint*)lh->block, lh->n);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from the log to their home location,
+// if the log holds all of them intact.
 static void
-install_trans(int recovering)
+install_from_log(struct logheader *lh, int h)
 {
+  struct buf **lbuf = log.lbuf, **dbuf = log.dbuf;
+  uint sum;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if (lh->n <= 0 || lh->n > log.cap)
+    return;
+  if (2*lh->n > bcount())
+    panic("install_from_log: too few buffers");
+
+  for (tail = 0; tail < lh->n; tail++)
+    lbuf[tail] = bread_async(log.dev, loghead(h)+tail+1); // read log block
+  sum = cksum_head(lh);
+  for (tail = 0; tail < lh->n; tail++) {
+    bwait(lbuf[tail]);
+    sum = cksum(sum, (uint*)lbuf[tail]->data, BSIZE/sizeof(uint));
+  }
+  if (sum != lh->cksum) {
+    // the crash interrupted the commit.
+    for (tail = 0; tail < lh->n; tail++)
+      brelse(lbuf[tail]);
+    return;
   }
+
+  for (tail = 0; tail < lh->n; tail++)
+    dbuf[tail] = bread_async(log.dev, lh->block[tail]); // read dst
+  for (tail = 0; tail < lh->n; tail++) {
+    bwait(dbuf[tail]);
+    memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+    bwrite_async(dbuf[tail]);  // write dst to disk
+    brelse(lbuf[tail]);
+  }
+  for (tail = 0; tail < lh->n; tail++) {
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
+  }
+}
+
+// Called by the disk interrupt when a block of a committed
+// transaction reaches its home location.
+static void
+installed(struct buf *b, int h)
+{
+  b->iodone = 0;
+  bunpin(b);
+  acquire(&log.lock);
+  if(--log.ninstall[h] == 0)
+    wakeup(&log.ninstall[h]);
+  release(&log.lock);
 }
 
-// Read the log header from disk into the in-memory log header
 static void
-read_head(void)
+installed0(struct buf *b)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  installed(b, 0);
+}
+
+static void
+installed1(struct buf *b)
+{
+  installed(b, 1);
+}
+
+// Start writing the committed transaction, which is in half h
+// of the log, from the cache to home locations, without waiting.
+// Blocks that the open transaction has modified are left for
+// it; the log keeps this transaction's copy until the open one
+// commits. Takes one buffer lock at a time, since system calls
+// of the open transaction hold some.
+static void
+install_trans(int h)
+{
+  struct buf *b;
+  int tail, inuse;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = bread(log.dev, log.clh.block[tail]);  // cached and pinned
+    // with b locked, no sys call is half-way through changing it.
+    acquire(&log.lock);
+    inuse = lookup(b->blockno) >= 0;
+    if (!inuse)
+      log.ninstall[h]++;
+    release(&log.lock);
+    if (inuse) {
+      bunpin(b);
+    } else {
+      b->iodone = h ? installed1 : installed0;
+      bwrite_async(b);
+    }
+    brelse(b);
+  }
+}
+
+// Read the header of half h of the log from disk.
+static void
+read_head(int h, struct logheader *lh)
+{
+  struct buf *buf = bread(log.dev, loghead(h));
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  lh->cksum = hb->cksum;
+  if (lh->n < 0 || lh->n > MAXLOG)
+    lh->n = 0;  // garbage; can't have been committed
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy lh into the locked header block buf of the log.
 static void
-write_head(void)
+fill_head(struct buf *buf, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  hb->cksum = lh->cksum;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
+}
+
+// Write lh to the header of half h of the log.
+static void
+write_head(int h, struct logheader *lh)
+{
+  struct buf *buf = bread(log.dev, loghead(h));
+  fill_head(buf, lh);
   bwrite(buf);
   brelse(buf);
 }
@@ -116,43 +314,78 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  // the in-memory headers are free to hold the two halves' headers.
+  struct logheader *lh[2] = { &log.lh, &log.clh };
+  int h;
+
+  read_head(0, lh[0]);
+  read_head(1, lh[1]);
+  // if committed, copy from log to disk, older half first.
+  h = (lh[0]->n > 0 && lh[1]->n > 0 && lh[1]->seq < lh[0]->seq);
+  install_from_log(lh[h], h);
+  install_from_log(lh[!h], !h);
+  log.seq = (lh[0]->seq > lh[1]->seq ? lh[0]->seq : lh[1]->seq) + 1;
+  // clear the log
+  lh[0]->n = 0;
+  write_head(0, lh[0]);
+  write_head(1, lh[0]);
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.lh.seq = log.seq;
+  clearhash();
 }
 
-// called at the start of each FS system call.
+// The most blocks one FS system call may write.
+int
+log_maxop(void)
+{
+  return log.cap;
+}
+
+// called at the start of each FS system call that
+// writes up to n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > log.cap)
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      log.nops += 1;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of each FS system call,
+// with the n passed to begin_opn().
+// commits if this was the last outstanding operation,
+// and no commit is in progress; otherwise the commit
+// in progress commits the open transaction when it is done.
+void
+end_opn(int n)
 {
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= n;
+  if(log.outstanding == 0 && log.lh.n > 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,38 +400,115 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Copy modified blocks from cache to half h of the log, and
+// write them with the header. When all the writes are done,
+// the transaction has committed.
 static void
-write_log(void)
+write_log(int h)
 {
+  struct buf **to = log.lbuf, *hb;
+  uint sum;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  sum = cksum_head(&log.clh);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    to[tail] = bread(log.dev, loghead(h)+tail+1); // log block
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    memmove(to[tail]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
+    sum = cksum(sum, (uint*)to[tail]->data, BSIZE/sizeof(uint));
+  }
+
+  // let the next transaction start changing blocks.
+  acquire(&log.lock);
+  log.copying = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  log.clh.cksum = sum;
+  hb = bread(log.dev, loghead(h));
+  fill_head(hb, &log.clh);
+  bwrite_async(hb);
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwrite_async(to[tail]);  // write the log
+  bwait(hb);
+  brelse(hb);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
+  }
+}
+
+// Wait up to GCWINDOW for other sys calls to join the open
+// transaction, if recent transactions have had company.
+// Returns with log.lock held.
+static void
+group_window(void)
+{
+  uint64 t0;
+
+  acquire(&log.lock);
+  if(log.lastops <= 1)
+    return;
+  t0 = r_time();
+  while(log.outstanding == 0 && log.lh.n < log.cap/2 &&
+        r_time() - t0 < GCWINDOW){
+    release(&log.lock);
+    yield();
+    acquire(&log.lock);
   }
 }
 
+// Commit the open transaction, and then any transaction
+// that became ready while it was being written.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  int h;
+
+  while(1){
+    group_window();
+    // the open transaction goes in the half of the log that holds
+    // the transaction before last. its blocks must be home first.
+    h = log.lh.seq % 2;
+    while(log.ninstall[h] > 0)
+      sleep(&log.ninstall[h], &log.lock);
+    if(log.outstanding > 0 || log.lh.n == 0){
+      // the last end_opn() of the open transaction commits it.
+      log.committing = 0;
+      wakeup(&log);
+      release(&log.lock);
+      return;
+    }
+
+    // close the open transaction, and hold off new sys
+    // calls until its blocks are copied to the log.
+    log.clh = log.lh;
+    log.lastops = log.nops;
+    log.nops = 0;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.lh.seq = ++log.seq;
+    clearhash();
+    log.copying = 1;
+    release(&log.lock);
+
+    write_log(h);      // Write header and modified blocks -- the real commit
+    install_trans(h);  // Start installing writes to home locations
+
+    acquire(&log.lock);
+    // begin_op() may be waiting for the space this commit freed.
+    wakeup(&log);
+    release(&log.lock);
   }
 }
 
@@ -217,20 +527,18 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
-      break;
-  }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (lookup(b->blockno) < 0) {  // Add new block to log?
+    // else log absorption
+    if (log.lh.n >= log.cap)
+      panic("too big a transaction");
+    i = log.lh.n++;
+    log.lh.block[i] = b->blockno;
+    log.hnext[i] = log.hhead[b->blockno % NLOGHASH];
+    log.hhead[b->blockno % NLOGHASH] = i;
     bpin(b);
-    log.lh.n++;
   }
   release(&log.lock);
 }
-
@@ -26,9 +26,12 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    dcacheinit();    // directory entry cache
     fileinit();      // file table
+    statsinit();     // statistics device
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kthread("writeback", writeback); // flushes delayed appends
     __sync_synchronize();
     started = 1;
   } else {
@@ -2,12 +2,20 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // in-memory i-nodes before unused ones are recycled
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*6)  // data blocks in each half of the log made by mkfs
+#define NBUF         (LOGSIZE*5)  // minimum size of disk block cache
+#ifndef BUFMEM
+#define BUFMEM       256   // disk block cache gets 1/BUFMEM of free memory
+#endif
+#define NREADAHEAD   16  // max blocks read ahead of a sequential reader
+#define NPREALLOC    16  // blocks reserved for each file being written
+#define NDELAY       4   // blocks of appends held before allocating them
+#define FLUSHBLOCKS  (2*NDELAY+4)  // max log blocks iflush() writes
+#define WBTICKS      30  // ticks before the writeback thread flushes appends
+#define FSSIZE       20000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
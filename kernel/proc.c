@@ -4,6 +4,7 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "rusage.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -15,14 +16,35 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// mask of harts that have entered scheduler().
+static volatile int cpus_online;
+
+// pid -> proc hash table, so that kill() and other
+// pid-keyed lookups need not scan proc[].
+// maintained by allocproc() and freeproc().
+// a proc's p->lock is acquired before pidhash.lock.
+#define NPIDHASH NPROC
+struct {
+  struct spinlock lock;
+  struct proc *bucket[NPIDHASH];
+} pidhash;
+
+// default affinity: any hart may run the process.
+#define ALLCPUS ((1 << NCPU) - 1)
+
 extern void forkret(void);
+void kthreadret(void);
 static void freeproc(struct proc *p);
+static void kickidle(int affinity);
 
 extern char trampoline[]; // trampoline.S
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
+// also protects the children and zombies
+// lists, so that wait() and exit() touch
+// only the processes involved.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
@@ -50,6 +72,7 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  initlock(&pidhash.lock, "pidhash");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->kstack = KSTACK((int) (p - proc));
@@ -97,6 +120,66 @@ allocpid() {
   return pid;
 }
 
+// Add p to the pid hash table.
+// p->lock must be held, and p->pid must be set.
+static void
+pidhash_insert(struct proc *p)
+{
+  struct proc **pp = &pidhash.bucket[p->pid % NPIDHASH];
+
+  acquire(&pidhash.lock);
+  p->pidnext = *pp;
+  *pp = p;
+  release(&pidhash.lock);
+}
+
+// Remove p from the pid hash table, if it is there.
+// p->lock must be held.
+static void
+pidhash_remove(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pidhash.lock);
+  for(pp = &pidhash.bucket[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pidnext = 0;
+  release(&pidhash.lock);
+}
+
+// Look up the process with the given pid.
+// Returns with p->lock held, or 0 if there is no such process.
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+
+  acquire(&pidhash.lock);
+  for(p = pidhash.bucket[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pidhash.lock);
+  if(p == 0)
+    return 0;
+
+  // p may have been freed after pidhash.lock was released.
+  // pids are never reused, so checking again under
+  // p->lock is enough.
+  acquire(&p->lock);
+  if(p->pid != pid){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -119,6 +202,9 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  pidhash_insert(p);
+  p->affinity = ALLCPUS;
+  p->lastcpu = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -157,12 +243,25 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  if(p->pid)
+    pidhash_remove(p);
   p->pid = 0;
   p->parent = 0;
+  p->children = p->sibling = 0;
+  p->zombies = p->znext = 0;
   p->name[0] = 0;
+  p->kfn = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->affinity = 0;
+  p->lastcpu = -1;
+  p->migrations = 0;
+  p->tstamp = 0;
+  p->utime = p->stime = 0;
+  p->nvcsw = p->nivcsw = p->nfault = 0;
+  p->cutime = p->cstime = 0;
+  p->cnvcsw = p->cnivcsw = p->cnfault = 0;
   p->state = UNUSED;
 }
 
@@ -247,6 +346,22 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread, a process that runs fn in the kernel
+// and never returns to user space.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -303,34 +418,71 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // the child inherits the parent's hart affinity.
+  np->affinity = p->affinity;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
   np->state = RUNNABLE;
   release(&np->lock);
+  kickidle(np->affinity);
 
   return pid;
 }
 
-// Pass p's abandoned children to init.
+// Pass p's abandoned children, live and exited, to init.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
+  if(p->children == 0)
+    return;
+
+  for(pp = p->children; ; pp = pp->sibling){
+    pp->parent = initproc;
+    if(pp->sibling == 0)
+      break;
+  }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+
+  if(p->zombies){
+    for(pp = p->zombies; pp->znext; pp = pp->znext)
+      ;
+    pp->znext = initproc->zombies;
+    initproc->zombies = p->zombies;
+    p->zombies = 0;
+  }
+
+  wakeup(initproc);
+}
+
+// Remove np from p's children list.
+// Caller must hold wait_lock.
+static void
+unlinkchild(struct proc *p, struct proc *np)
+{
+  struct proc **pp;
+
+  for(pp = &p->children; *pp; pp = &(*pp)->sibling){
+    if(*pp == np){
+      *pp = np->sibling;
+      break;
     }
   }
+  np->sibling = 0;
 }
 
 // Exit the current process.  Does not return.
@@ -371,6 +523,10 @@ exit(int status)
   p->xstate = status;
   p->state = ZOMBIE;
 
+  // Let wait() find us without scanning.
+  p->znext = p->parent->zombies;
+  p->parent->zombies = p;
+
   release(&wait_lock);
 
   // Jump into the scheduler, never to return.
@@ -384,40 +540,39 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int pid;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
-          release(&np->lock);
-          release(&wait_lock);
-          return pid;
-        }
+    if((np = p->zombies) != 0){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      pid = np->pid;
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                              sizeof(np->xstate)) < 0) {
         release(&np->lock);
+        release(&wait_lock);
+        return -1;
       }
+      p->cutime += np->utime + np->cutime;
+      p->cstime += np->stime + np->cstime;
+      p->cnvcsw += np->nvcsw + np->cnvcsw;
+      p->cnivcsw += np->nivcsw + np->cnivcsw;
+      p->cnfault += np->nfault + np->cnfault;
+      p->zombies = np->znext;
+      np->znext = 0;
+      unlinkchild(p, np);
+      freeproc(np);
+      release(&np->lock);
+      release(&wait_lock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(p->children == 0 || p->killed){
       release(&wait_lock);
       return -1;
     }
@@ -427,33 +582,82 @@ wait(uint64 addr)
   }
 }
 
+// Is there a process this hart could run?
+// Reads p->state without p->lock, so the answer
+// is only a hint; see the idle protocol in scheduler().
+static int
+anyrunnable(int id)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++)
+    if(p->state == RUNNABLE && (p->affinity & (1 << id)))
+      return 1;
+  return 0;
+}
+
+// A process allowed on the harts in affinity has just become
+// RUNNABLE. If one of those harts is idle in wfi, send it an
+// IPI so it notices. Must be called after p->state is set.
+static void
+kickidle(int affinity)
+{
+  int i;
+
+  // order the p->state store before the loads of idle;
+  // scheduler() does the reverse.
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    if((affinity & (1 << i)) == 0)
+      continue;
+    if(__sync_bool_compare_and_swap(&cpus[i].idle, 1, 0)){
+      *(volatile uint32 *)CLINT_MSIP(i) = 1;
+      return;
+    }
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run whose affinity
+//    includes this CPU.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+//  - if there was nothing to run, wait in wfi
+//    for an interrupt or an IPI from kickidle().
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  int found;
+  uint64 t0;
   
   c->proc = 0;
+  __sync_fetch_and_or(&cpus_online, 1 << id);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
+    found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && (p->affinity & (1 << id))) {
+        found = 1;
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
+        if(p->lastcpu >= 0 && p->lastcpu != id)
+          p->migrations++;
+        p->lastcpu = id;
+        p->tstamp = t0 = r_time();
         c->proc = p;
         swtch(&c->context, &p->context);
+        c->busytime += r_time() - t0;
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
@@ -461,6 +665,23 @@ scheduler(void)
       }
       release(&p->lock);
     }
+
+    if(!found){
+      // Nothing to run. Advertise that this hart is idle,
+      // then look once more: a waker either sees idle set and
+      // sends an IPI, or made its process RUNNABLE before our
+      // check. With interrupts off, a pending interrupt still
+      // ends wfi, and is taken by the intr_on() above.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(!anyrunnable(id)){
+        t0 = r_time();
+        asm volatile("wfi");
+        c->idletime += r_time() - t0;
+      }
+      c->idle = 0;
+    }
   }
 }
 
@@ -486,6 +707,14 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // charge kernel time up to the switch; scheduler()
+  // restarts the clock when p next runs.
+  p->stime += r_time() - p->tstamp;
+  if(p->state == SLEEPING)
+    p->nvcsw++;
+  else if(p->state == RUNNABLE)
+    p->nivcsw++;
+
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -498,6 +727,10 @@ yield(void)
   struct proc *p = myproc();
   acquire(&p->lock);
   p->state = RUNNABLE;
+  // this hart's scheduler will find p, unless p may
+  // not run here (see setaffinity()).
+  if((p->affinity & (1 << cpuid())) == 0)
+    kickidle(p->affinity);
   sched();
   release(&p->lock);
 }
@@ -523,6 +756,19 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthreadret");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -566,12 +812,31 @@ wakeup(void *chan)
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
         p->state = RUNNABLE;
+        release(&p->lock);
+        kickidle(p->affinity);
+        continue;
       }
       release(&p->lock);
     }
   }
 }
 
+// Wake p if it is sleeping on chan. Like wakeup(),
+// but for a caller that knows which process to wake.
+// Must be called without p->lock.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan) {
+    p->state = RUNNABLE;
+    release(&p->lock);
+    kickidle(p->affinity);
+    return;
+  }
+  release(&p->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -580,20 +845,111 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    p->state = RUNNABLE;
     release(&p->lock);
+    kickidle(p->affinity);
+    return 0;
   }
-  return -1;
+  release(&p->lock);
+  return 0;
+}
+
+// Restrict the process with the given pid (0 means the
+// caller) to the harts in mask. Harts that are not running
+// are dropped from the mask.
+// Returns 0, or -1 if there is no such process or the
+// mask names no running hart.
+int
+setaffinity(int pid, int mask)
+{
+  struct proc *p;
+  struct proc *me = myproc();
+  int here, runnable;
+
+  mask &= cpus_online;
+  if(mask == 0)
+    return -1;
+  if(pid == 0)
+    pid = me->pid;
+
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->affinity = mask;
+  runnable = (p->state == RUNNABLE);
+  release(&p->lock);
+  if(runnable)
+    kickidle(mask);  // harts it may now run on may be idle
+
+  if(p == me){
+    // move off this hart now if it is no longer allowed.
+    push_off();
+    here = cpuid();
+    pop_off();
+    if((mask & (1 << here)) == 0)
+      yield();
+  }
+  return 0;
+}
+
+// Return the affinity mask of the process with the given
+// pid (0 means the caller), or -1 if there is no such process.
+int
+getaffinity(int pid)
+{
+  struct proc *p;
+  int mask;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+
+  if((p = findproc(pid)) == 0)
+    return -1;
+  mask = p->affinity;
+  release(&p->lock);
+  return mask;
+}
+
+// Copy the resource usage of the caller (RUSAGE_SELF) or
+// of its reaped children (RUSAGE_CHILDREN) to user address addr.
+// Returns 0 on success, -1 on error.
+int
+getrusage(int who, uint64 addr)
+{
+  struct proc *p = myproc();
+  struct rusage ru;
+  uint64 now;
+
+  if(who == RUSAGE_SELF){
+    // bring stime up to date; interrupts off so that
+    // a yield() can't update it underneath us.
+    push_off();
+    now = r_time();
+    p->stime += now - p->tstamp;
+    p->tstamp = now;
+    pop_off();
+    ru.utime = p->utime;
+    ru.stime = p->stime;
+    ru.nvcsw = p->nvcsw;
+    ru.nivcsw = p->nivcsw;
+    ru.nfault = p->nfault;
+  } else if(who == RUSAGE_CHILDREN){
+    ru.utime = p->cutime;
+    ru.stime = p->cstime;
+    ru.nvcsw = p->cnvcsw;
+    ru.nivcsw = p->cnivcsw;
+    ru.nfault = p->cnfault;
+  } else {
+    return -1;
+  }
+
+  if(copyout(p->pagetable, addr, (char *)&ru, sizeof(ru)) < 0)
+    return -1;
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -640,9 +996,16 @@ procdump(void)
   [ZOMBIE]    "zombie"
   };
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if((cpus_online & (1 << (c - cpus))) == 0)
+      continue;
+    printf("hart %d busy=%dk idle=%dk\n", (int)(c - cpus),
+           (int)(c->busytime / 1000), (int)(c->idletime / 1000));
+  }
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->state == UNUSED)
       continue;
@@ -651,6 +1014,10 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" affinity=%x migrations=%d", p->affinity, p->migrations);
+    printf(" utime=%dk stime=%dk csw=%d/%d faults=%d",
+           (int)(p->utime / 1000), (int)(p->stime / 1000),
+           (int)p->nvcsw, (int)p->nivcsw, (int)p->nfault);
     printf("\n");
   }
 }
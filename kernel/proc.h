@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in wfi for work? (see kickidle())
+  uint64 idletime;            // Time CSR cycles with nothing to run
+  uint64 busytime;            // Time CSR cycles running processes
 };
 
 extern struct cpu cpus[NCPU];
@@ -92,9 +95,24 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int affinity;                // Mask of harts allowed to run this process
+  int lastcpu;                 // Hart that last ran this process, or -1
+  int migrations;              // Times scheduled on a different hart than last time
 
-  // wait_lock must be held when using this:
+  // the lk of the sleeplock being waited for must be held when using these:
+  struct proc *slnext;         // Next waiter in that sleeplock's queue
+  int slshared;                // Waiting for shared access?
+  int slwait;                  // Not yet granted the lock
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // All children, linked by sibling
+  struct proc *sibling;        // Next in parent's children list
+  struct proc *zombies;        // Exited children not yet waited for
+  struct proc *znext;          // Next in parent's zombies list
+
+  // pidhash.lock must be held when using this:
+  struct proc *pidnext;        // Next in pid hash chain
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -105,4 +123,20 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Kernel thread's body, or 0
+
+  // CPU accounting, in time CSR cycles. updated only by the
+  // process itself, with interrupts off, on trap entry and
+  // exit and in sched().
+  uint64 tstamp;               // When the current interval began
+  uint64 utime;                // Time spent in user mode
+  uint64 stime;                // Time spent in the kernel
+  uint64 nvcsw;                // Voluntary context switches
+  uint64 nivcsw;               // Involuntary context switches
+  uint64 nfault;               // Page faults
+  uint64 cutime;               // Totals for reaped children
+  uint64 cstime;
+  uint64 cnvcsw;
+  uint64 cnivcsw;
+  uint64 cnfault;
 };
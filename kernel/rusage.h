@@ -0,0 +1,12 @@
+// resource usage, returned by getrusage().
+// times are in cycles of the time CSR (10 MHz under qemu).
+struct rusage {
+  uint64 utime;     // time spent in user mode
+  uint64 stime;     // time spent in the kernel
+  uint64 nvcsw;     // voluntary context switches (sleeps)
+  uint64 nivcsw;    // involuntary context switches (preemptions)
+  uint64 nfault;    // page faults
+};
+
+#define RUSAGE_SELF      0   // the calling process
+#define RUSAGE_CHILDREN  -1  // all of its reaped children
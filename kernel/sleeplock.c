@@ -9,24 +9,121 @@
 #include "proc.h"
 #include "sleeplock.h"
 
+// how many times acquiresleep() polls a held lock whose
+// owner is running on another hart before going to sleep.
+#define SLEEPSPIN 1000
+
+// how often each path through the sleeplock code is
+// taken. per-CPU, and updated while holding lk->lk,
+// so that no atomics are needed.
+static struct {
+  uint64 nfree;     // exclusive lock was free
+  uint64 nspin;     // acquired after polling while the owner ran
+  uint64 nshared;   // shared lock granted without waiting
+  uint64 nsleep;    // slept until handed the lock
+  uint64 nhandoff;  // a release passed the lock to waiters
+} sstats[NCPU];
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->nreaders = 0;
+  lk->owner = 0;
+  lk->waithead = lk->waittail = 0;
   lk->pid = 0;
 }
 
+// Join lk's queue and sleep until a release grants
+// us the lock. Caller must hold lk->lk.
+static void
+waitsleep(struct sleeplock *lk, int shared)
+{
+  struct proc *p = myproc();
+
+  p->slnext = 0;
+  p->slshared = shared;
+  p->slwait = 1;
+  if(lk->waittail)
+    lk->waittail->slnext = p;
+  else
+    lk->waithead = p;
+  lk->waittail = p;
+  sstats[cpuid()].nsleep++;
+  while(p->slwait)
+    sleep(lk, &lk->lk);
+}
+
+// lk has just become free: grant it to the oldest waiter
+// if it wants exclusive access, or else to every shared
+// waiter before the next exclusive one. only the granted
+// processes are woken. Caller must hold lk->lk.
+static void
+handoff(struct sleeplock *lk)
+{
+  struct proc *p;
+  int shared;
+
+  if(lk->waithead)
+    sstats[cpuid()].nhandoff++;
+  while((p = lk->waithead) != 0){
+    shared = p->slshared;
+    if(!shared && lk->nreaders > 0)
+      break;
+    lk->waithead = p->slnext;
+    if(lk->waithead == 0)
+      lk->waittail = 0;
+    p->slnext = 0;
+    if(shared){
+      lk->nreaders++;
+    } else {
+      lk->locked = 1;
+      lk->owner = p;
+      lk->pid = p->pid;
+    }
+    p->slwait = 0;
+    wakeproc(p, lk);
+    if(!shared)
+      break;
+  }
+}
+
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *p = myproc();
+  struct proc *o;
+  int spins = 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if(lk->locked && lk->waithead == 0){
+    // an owner running on another hart will likely release
+    // soon, so poll for a while rather than sleep.
+    // lk->owner and o->state are only read as hints.
+    release(&lk->lk);
+    for(; spins < SLEEPSPIN; spins++){
+      if(*(volatile uint *)&lk->locked == 0)
+        break;
+      o = *(struct proc * volatile *)&lk->owner;
+      if(o == 0 || o->state != RUNNING)
+        break;
+    }
+    acquire(&lk->lk);
+  }
+
+  if(lk->locked || lk->nreaders > 0 || lk->waithead){
+    waitsleep(lk, 0);
+  } else {
+    lk->locked = 1;
+    lk->owner = p;
+    lk->pid = p->pid;
+    if(spins > 0)
+      sstats[cpuid()].nspin++;
+    else
+      sstats[cpuid()].nfree++;
   }
-  lk->locked = 1;
-  lk->pid = myproc()->pid;
   release(&lk->lk);
 }
 
@@ -35,8 +132,36 @@ releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->owner = 0;
   lk->pid = 0;
-  wakeup(lk);
+  handoff(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk shared with other readers. New readers
+// queue behind a waiting writer, so writers don't starve.
+void
+acquiresleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->locked || lk->waithead){
+    waitsleep(lk, 1);
+  } else {
+    lk->nreaders++;
+    sstats[cpuid()].nshared++;
+  }
+  release(&lk->lk);
+}
+
+void
+releasesleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->nreaders < 1)
+    panic("releasesleep_shared");
+  lk->nreaders--;
+  if(lk->nreaders == 0)
+    handoff(lk);
   release(&lk->lk);
 }
 
@@ -51,5 +176,21 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+// Print the sleeplock path counters into buf.
+// Returns the number of bytes written.
+int
+statssleeplock(char *buf, int sz)
+{
+  uint64 nfree = 0, nspin = 0, nshared = 0, nsleep = 0, nhandoff = 0;
 
-
+  for(int i = 0; i < NCPU; i++){
+    nfree += sstats[i].nfree;
+    nspin += sstats[i].nspin;
+    nshared += sstats[i].nshared;
+    nsleep += sstats[i].nsleep;
+    nhandoff += sstats[i].nhandoff;
+  }
+  return snprintf(buf, sz,
+                  "sleeplock: #free %d #spin %d #shared %d #sleep %d #handoff %d\n",
+                  (int)nfree, (int)nspin, (int)nshared, (int)nsleep, (int)nhandoff);
+}
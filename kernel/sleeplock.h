@@ -1,10 +1,16 @@
-// Long-term locks for processes
+// Long-term locks for processes.
+// Held either exclusively by one process (locked),
+// or shared by several readers (nreaders).
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int nreaders;      // Number of processes holding it shared
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *owner; // Process holding lock exclusively
+  struct proc *waithead; // Processes waiting for the lock, oldest first
+  struct proc *waittail;
   
   // For debugging:
   char *name;        // Name of lock.
-  int pid;           // Process holding lock
+  int pid;           // Process holding lock exclusively
 };
 
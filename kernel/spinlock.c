@@ -8,12 +8,53 @@
 #include "proc.h"
 #include "defs.h"
 
+// every lock initialized with initlock(), for statslock().
+#define NLOCK 1000
+static struct spinlock *locks[NLOCK];
+static struct spinlock lock_locks = { .name = "lock_locks" };
+
 void
 initlock(struct spinlock *lk, char *name)
 {
+  int i;
+
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->ldclass = 0;
+  lk->nacquire = 0;
+  lk->nspin = 0;
+  for(i = 0; i < NLOCKHIST; i++)
+    lk->hold[i] = 0;
+
+  // remember the lock for statslock(). if the table is
+  // full, the lock works but isn't reported.
+  acquire(&lock_locks);
+  for(i = 0; i < NLOCK; i++){
+    if(locks[i] == 0){
+      locks[i] = lk;
+      break;
+    }
+  }
+#ifdef LOCKDEP
+  lockdep_init(lk);
+#endif
+  release(&lock_locks);
+}
+
+// Forget a lock in memory that is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == lk){
+      locks[i] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
 }
 
 // Acquire the lock.
@@ -21,16 +62,27 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+  uint64 spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+#ifdef LOCKDEP
+  // check the lock order before waiting, in case it deadlocks.
+  lockdep_acquire(lk);
+#endif
+
+  // Take a ticket. On RISC-V, sync_fetch_and_add turns into
+  // an atomic add:
+  //   amoadd.w.aqrl a5, a5, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+
+  // Wait for our turn. Waiters only read owner, so the
+  // cache line stays shared until the holder releases.
+  while(*(volatile uint *)&lk->owner != ticket)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +92,27 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->nacquire++;
+  lk->nspin += spins;
+  lk->tacquire = r_time();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint64 t;
+  int i;
+
   if(!holding(lk))
     panic("release");
 
+  // record the hold time in the histogram.
+  t = r_time() - lk->tacquire;
+  for(i = 0; i < NLOCKHIST - 1 && t >= (1L << (2*i)); i++)
+    ;
+  lk->hold[i]++;
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +123,18 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket. This code doesn't use a C
+  // assignment, since the C standard implies that an
+  // assignment might be implemented with multiple store
+  // instructions. Only the holder writes owner.
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
+  //   amoadd.w.aqrl zero, a5, (s1)
+  __sync_fetch_and_add(&lk->owner, 1);
+
+#ifdef LOCKDEP
+  // after the release, since it may print.
+  lockdep_release(lk, t);
+#endif
 
   pop_off();
 }
@@ -77,7 +145,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->next != lk->owner && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +176,51 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Print statistics for each class of lock (locks with the
+// same name) into buf. Returns the number of bytes written.
+int
+statslock(char *buf, int sz)
+{
+  struct spinlock *lk;
+  uint64 n, spin, hold[NLOCKHIST];
+  int i, j, k, off, seen;
+
+  off = 0;
+  acquire(&lock_locks);
+  for(i = 0; i < NLOCK; i++){
+    if(locks[i] == 0)
+      continue;
+
+    // report each name once, at its first lock.
+    seen = 0;
+    for(j = 0; j < i && !seen; j++)
+      if(locks[j] && strncmp(locks[j]->name, locks[i]->name, 32) == 0)
+        seen = 1;
+    if(seen)
+      continue;
+
+    n = spin = 0;
+    for(k = 0; k < NLOCKHIST; k++)
+      hold[k] = 0;
+    for(j = i; j < NLOCK; j++){
+      lk = locks[j];
+      if(lk == 0 || strncmp(lk->name, locks[i]->name, 32) != 0)
+        continue;
+      n += lk->nacquire;
+      spin += lk->nspin;
+      for(k = 0; k < NLOCKHIST; k++)
+        hold[k] += lk->hold[k];
+    }
+    if(n == 0)
+      continue;
+
+    off += snprintf(buf+off, sz-off, "lock: %s: #acquire %d #spin %d hold",
+                    locks[i]->name, (int)n, (int)spin);
+    for(k = 0; k < NLOCKHIST; k++)
+      off += snprintf(buf+off, sz-off, " %d", (int)hold[k]);
+    off += snprintf(buf+off, sz-off, "\n");
+  }
+  release(&lock_locks);
+  return off;
+}
@@ -1,9 +1,20 @@
 // Mutual exclusion lock.
+// A ticket lock: acquire() takes the next ticket and spins
+// until owner reaches it, so waiters are served in order.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out
+  uint owner;        // Ticket being served
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+  int ldclass;       // Lock class + 1 for lockdep.c, or 0
+
+  // Statistics, updated while the lock is held:
+#define NLOCKHIST 8
+  uint64 nacquire;   // Number of acquire()s
+  uint64 nspin;      // Iterations spent waiting in acquire()
+  uint64 tacquire;   // time CSR when last acquired
+  uint64 hold[NLOCKHIST]; // Hold times: [i] counts < 4^i cycles, last is the rest
 };
 
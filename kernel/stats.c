@@ -0,0 +1,74 @@
+//
+// the statistics device: reading it returns a
+// snapshot of the kernel's spinlock, sleeplock, disk and
+// directory entry cache statistics.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 8192
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// the snapshot is taken on the first read, and
+// consumed by later reads until they reach its end.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquire(&stats.lock);
+
+  if(stats.sz == 0) {
+    stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += statssleeplock(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdisk(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+#ifdef LOCKDEP
+    stats.sz += statslockdep(stats.buf+stats.sz, BUFSZ-stats.sz);
+#endif
+  }
+  m = stats.sz - stats.off;
+
+  if (m > 0) {
+    if(m > n)
+      m  = n;
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) != -1) {
+      stats.off += m;
+    }
+  } else {
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -169,16 +169,22 @@ bad:
 static int
 isdirempty(struct inode *dp)
 {
-  int off;
+  int off, empty;
   struct dirent de;
+  struct iblk it;
 
+  empty = 1;
+  iblkinit(&it, dp);
   for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    if(iblkread(&it, &de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
+    if(de.inum != 0){
+      empty = 0;
+      break;
+    }
   }
-  return 1;
+  iblkrelse(&it);
+  return empty;
 }
 
 uint64
@@ -218,6 +224,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp->dev, dp->inum, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -268,6 +275,8 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
+    // forget the entries of any directory that had this i-node.
+    dcache_purge(ip->dev, ip->inum);
     dp->nlink++;  // for ".."
     iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
@@ -336,6 +345,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->raoff = 0;
+    f->rablock = 0;
+    f->rawin = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -484,3 +496,13 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_diskmode(void)
+{
+  int mode;
+
+  if(argint(0, &mode) < 0)
+    return -1;
+  return virtio_disk_mode(mode);
+}
@@ -16,6 +16,16 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "diskmode.h"
+
+// how long virtio_disk_wait() polls in DISK_POLL mode,
+// in cycles of the time CSR (10 MHz under qemu).
+#define POLLTIME 1000
+
+// latency histogram buckets: bucket i counts requests that
+// took less than 2^i * LATUNIT cycles; the last, the rest.
+#define NLATHIST 12
+#define LATUNIT  40  // 4 us
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
@@ -24,8 +34,9 @@ static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // contiguous pages of page-aligned physical memory: three of them
+  // for a queue of NUM descriptors.
+  char pages[3*PGSIZE];
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -34,34 +45,66 @@ static struct disk {
   
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
-  // and write individual disk operations. there are NUM descriptors.
-  // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // and write individual disk operations. there are num descriptors.
+  // with indirect descriptors, each command is one descriptor that
+  // points to a table of them in indirect[]; otherwise it is a
+  // "chain" (a linked list) of several of these descriptors.
   // points into pages[].
   struct virtq_desc *desc;
 
   // next is a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   // points into pages[].
   struct virtq_avail *avail;
 
   // finally a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   // points into pages[].
   struct virtq_used *used;
 
+  // per-command descriptor tables, indexed by the command's
+  // descriptor in desc[], if the device does indirect descriptors.
+  struct virtq_desc indirect[NUM][MAXSEG+2] __attribute__ ((aligned (16)));
+  int useindirect;
+
+  // with VIRTIO_RING_F_EVENT_IDX, the device interrupts when
+  // used->idx passes *used_event, and the driver need only
+  // notify when avail->idx passes *avail_event. they sit just
+  // past the ends of the avail and used rings.
+  int useeventidx;
+  volatile uint16 *used_event;
+  volatile uint16 *avail_event;
+  int mode;        // DISK_ flags
+  int inflight;    // requests the device has not completed
+  int npolling;    // virtio_disk_wait()s polling the used ring
+
   // our own book-keeping.
+  int num;         // queue size agreed with the device
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;       // how many are
+  uint16 used_idx; // we've looked this far in used[2..num].
+
+  // bufs waiting for descriptors, sorted by block number and
+  // linked through qnext. once issued, the bufs of a request
+  // stay linked from its info[].b.
+  struct buf *queue;
+  uint nextblock;  // block after the last one issued
+
+  // requests issued, and blocks they transferred.
+  uint64 nreq;
+  uint64 nblock;
+  uint64 nintr;    // interrupts that completed something
+  uint64 npoll;    // waits satisfied by polling
+  uint64 lat[2][NLATHIST];  // read, write latency
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // first buf of the request
     char status;
   } info[NUM];
 
@@ -100,9 +143,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.useindirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.useeventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -119,23 +162,30 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  if(disk.num < 4)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
   memset(disk.pages, 0, sizeof(disk.pages));
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = pages + num * 16 -- 2 * uint16, then num * uint16
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem
 
+  uint64 usedoff = PGROUNDUP(disk.num*sizeof(struct virtq_desc) + (3+disk.num)*sizeof(uint16));
   disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
+  disk.avail = (struct virtq_avail *)(disk.pages + disk.num*sizeof(struct virtq_desc));
+  disk.used = (struct virtq_used *) (disk.pages + usedoff);
+  disk.used_event = (uint16 *) &disk.avail->ring[disk.num];
+  disk.avail_event = (uint16 *) &disk.used->ring[disk.num];
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all num descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
+  disk.nfree = disk.num;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -144,9 +194,10 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -157,7 +208,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -166,7 +217,7 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
@@ -184,80 +235,87 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// How many descriptors a request for n blocks takes from desc[].
 static int
-alloc3_desc(int *idx)
+ndesc(int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
-  return 0;
+  return disk.useindirect ? 1 : n+2;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Hand the device one request for the n blocks starting at
+// b, which are consecutive on disk and linked through qnext.
+// The caller has checked that ndesc(n) descriptors are free.
+static void
+submit(struct buf *b, int n)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  int idx[MAXSEG+2], next[MAXSEG+2];
+  struct virtq_desc *d[MAXSEG+2];
+  struct buf *bp;
+  int i;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+  // one descriptor for type/reserved/sector, one for each piece
+  // of the data, and one for a 1-byte status result. they go
+  // either in an indirect table or in a chain through desc[].
+  if(disk.useindirect){
+    idx[0] = alloc_desc();
+    for(i = 0; i < n+2; i++){
+      d[i] = &disk.indirect[idx[0]][i];
+      next[i] = i+1;
+    }
+    disk.desc[idx[0]].addr = (uint64) disk.indirect[idx[0]];
+    disk.desc[idx[0]].len = (n+2)*sizeof(struct virtq_desc);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+  } else {
+    for(i = 0; i < n+2; i++)
+      idx[i] = alloc_desc();
+    for(i = 0; i < n+2; i++){
+      d[i] = &disk.desc[idx[i]];
+      next[i] = i+1 < n+2 ? idx[i+1] : 0;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
-  if(write)
+  if(b->qwrite)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  buf0->sector = b->blockno * (BSIZE / 512);
+
+  d[0]->addr = (uint64) buf0;
+  d[0]->len = sizeof(struct virtio_blk_req);
+  d[0]->flags = VRING_DESC_F_NEXT;
+  d[0]->next = next[0];
+
+  for(i = 1, bp = b; i <= n; i++, bp = bp->qnext){
+    d[i]->addr = (uint64) bp->data;
+    d[i]->len = BSIZE;
+    if(b->qwrite)
+      d[i]->flags = 0; // device reads b->data
+    else
+      d[i]->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[i]->flags |= VRING_DESC_F_NEXT;
+    d[i]->next = next[i];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  d[n+1]->addr = (uint64) &disk.info[idx[0]].status;
+  d[n+1]->len = 1;
+  d[n+1]->flags = VRING_DESC_F_WRITE; // device writes the status
+  d[n+1]->next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
+  // record the bufs for virtio_disk_intr().
   disk.info[idx[0]].b = b;
+  disk.inflight++;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
@@ -266,17 +324,229 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
+  disk.nreq++;
+  disk.nblock += n;
+}
+
+// Issue queued bufs while there are descriptors for them.
+// Each request starts at the first queued block at or past
+// where the last request ended, wrapping around to the lowest
+// (an elevator), and takes with it the queued blocks that
+// follow on disk in the same direction.
+static void
+dispatch(void)
+{
+  struct buf **start, *b, *last;
+  uint16 old;
+  int n;
+
+  if(disk.queue == 0 || disk.nfree < ndesc(1))
+    return;
+
+  old = disk.avail->idx;
+
+  while(disk.queue && disk.nfree >= ndesc(1)){
+    for(start = &disk.queue; *start; start = &(*start)->qnext)
+      if((*start)->blockno >= disk.nextblock)
+        break;
+    if(*start == 0)
+      start = &disk.queue;
+
+    n = 1;
+    for(last = *start; last->qnext && n < MAXSEG && ndesc(n+1) <= disk.nfree;
+        last = last->qnext){
+      if(last->qnext->blockno != last->blockno + 1 ||
+         last->qnext->qwrite != last->qwrite)
+        break;
+      n++;
+    }
+
+    b = *start;
+    *start = last->qnext;
+    last->qnext = 0;
+    disk.nextblock = last->blockno + 1;
+    submit(b, n);
+  }
+
+  __sync_synchronize();
+
+  // with event indices, the device says which avail index
+  // it wants to hear about; it is polling the ring until then.
+  if(disk.useeventidx &&
+     (uint16)(disk.avail->idx - *disk.avail_event - 1) >= (uint16)(disk.avail->idx - old))
+    return;
+
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// Tell the device after how many more completions to interrupt.
+// Not at all while someone is polling the used ring; normally
+// after the next one; in DISK_EVENTIDX mode, after three
+// quarters of the requests in flight have completed.
+static void
+setevent(void)
+{
+  int n = 1;
+
+  if(!disk.useeventidx){
+    // the flag is only a hint: the device may interrupt anyway.
+    disk.avail->flags = disk.npolling > 0 ? VRING_AVAIL_F_NO_INTERRUPT : 0;
+    __sync_synchronize();
+    return;
+  }
+  if(disk.npolling > 0){
+    // an event index just behind used_idx is one the device
+    // won't pass for another 65536 completions.
+    *disk.used_event = disk.used_idx - 1;
+    __sync_synchronize();
+    return;
+  }
+  if((disk.mode & DISK_EVENTIDX) && disk.inflight*3/4 > 1)
+    n = disk.inflight*3/4;
+  *disk.used_event = disk.used_idx + n - 1;
+  __sync_synchronize();
+}
+
+// Finish the requests in the used ring. Caller holds vdisk_lock.
+// Returns how many were done.
+static int
+complete(void)
+{
+  struct buf *b, *next;
+  uint64 t;
+  int i, n;
+
+  n = 0;
+  // the device increments disk.used->idx when it
+  // adds an entry to the used ring.
+  while(disk.used_idx != disk.used->idx){
+    __sync_synchronize();
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
+
+    if(disk.info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    b = disk.info[id].b;
+    disk.info[id].b = 0;
+    free_chain(id);
+    disk.inflight--;
+
+    t = r_time() - b->qtime;
+    for(i = 0; i < NLATHIST - 1 && t >= ((uint64)LATUNIT << i); i++)
+      ;
+    disk.lat[b->qwrite][i]++;
+
+    for(; b; b = next){
+      next = b->qnext;
+      b->qnext = 0;
+      if(b->iodone)
+        b->iodone(b);
+      b->disk = 0;   // disk is done with buf
+      if(!b->qpoll)
+        wakeup(b);
+    }
+
+    disk.used_idx += 1;
+    n++;
+  }
+
+  if(n > 0){
+    // the freed descriptors can carry queued requests.
+    dispatch();
+    setevent();
+  }
+  return n;
+}
+
+// Queue a read or write of b and return without waiting.
+// virtio_disk_intr() clears b->disk when it is done.
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  struct buf **pp;
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&disk.vdisk_lock);
+
+  b->disk = 1;
+  b->qwrite = write;
+  b->qtime = r_time();
+
+  // keep the queue sorted by block number.
+  for(pp = &disk.queue; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+
+  dispatch();
+
+  release(&disk.vdisk_lock);
+}
+
+// Wait for virtio_disk_intr() to say b's request has finished.
+// Returns at once if no request for b is in flight.
+// In DISK_POLL mode, first check the used ring for POLLTIME,
+// with the device's interrupts turned off, which saves the
+// interrupt, the wakeup and the sleep on a fast device.
+void
+virtio_disk_wait(struct buf *b)
+{
+  uint64 t0;
+
+  acquire(&disk.vdisk_lock);
+  if(b->disk == 1 && (disk.mode & DISK_POLL)){
+    b->qpoll = 1;
+    disk.npolling++;
+    setevent();
+    t0 = r_time();
+    while(b->disk == 1 && r_time() - t0 < POLLTIME){
+      if(disk.used_idx == *(volatile uint16 *)&disk.used->idx){
+        // let other waiters in while we wait.
+        release(&disk.vdisk_lock);
+        acquire(&disk.vdisk_lock);
+        continue;
+      }
+      complete();
+    }
+    b->qpoll = 0;
+    disk.npolling--;
+    setevent();
+    // completions since interrupts were turned off won't
+    // raise one; finish them here, for any sleepers.
+    complete();
+    if(b->disk == 0)
+      disk.npoll++;
+  }
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Set the DISK_ mode flags, dropping those the device can't
+// support. Returns the old flags, or the current ones if
+// mode is -1.
+int
+virtio_disk_mode(int mode)
+{
+  int old;
 
+  acquire(&disk.vdisk_lock);
+  old = disk.mode;
+  if(mode != -1){
+    if(!disk.useeventidx)
+      mode &= ~DISK_EVENTIDX;
+    disk.mode = mode & (DISK_POLL | DISK_EVENTIDX);
+    setevent();
+  }
   release(&disk.vdisk_lock);
+  return old;
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
 }
 
 void
@@ -294,22 +564,38 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  if(complete() > 0)
+    disk.nintr++;
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  release(&disk.vdisk_lock);
+}
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+// Print how many requests the disk has been sent, how many
+// blocks and sectors they moved, how they were completed, and
+// their latency histograms, into buf.
+int
+statsdisk(char *buf, int sz)
+{
+  int i, w, off;
 
-    disk.used_idx += 1;
+  acquire(&disk.vdisk_lock);
+  off = snprintf(buf, sz, "disk: queue %d%s%s%s%s #req %d #block %d #sector %d"
+                 " #intr %d #poll %d\n",
+                 disk.num, disk.useindirect ? " indirect" : "",
+                 disk.useeventidx ? " eventidx" : "",
+                 (disk.mode & DISK_POLL) ? " poll" : "",
+                 (disk.mode & DISK_EVENTIDX) ? " coalesce" : "",
+                 (int)disk.nreq, (int)disk.nblock,
+                 (int)(disk.nblock * (BSIZE / 512)),
+                 (int)disk.nintr, (int)disk.npoll);
+  for(w = 0; w < 2; w++){
+    off += snprintf(buf+off, sz-off, "disk: %s latency (us)",
+                    w ? "write" : "read");
+    for(i = 0; i < NLATHIST - 1; i++)
+      off += snprintf(buf+off, sz-off, " <%d:%d",
+                      (LATUNIT << i) / 10, (int)disk.lat[w][i]);
+    off += snprintf(buf+off, sz-off, " more:%d\n", (int)disk.lat[w][i]);
   }
-
   release(&disk.vdisk_lock);
+  return off;
 }
@@ -18,12 +18,14 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free inode map |
+//                                          free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nimap = NINODES/(BSIZE*8) + 1;
+int nlog = 2*(LOGSIZE+1);  // two halves, each a header and LOGSIZE blocks
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, imap, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -31,15 +33,19 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+struct dirent rootents[NINODES+2];  // the root directory's entries
+int nrootents;
 
 
 void balloc(int);
+void iballoc(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void writedir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to intel byte order
@@ -69,10 +75,9 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum;
   struct dirent de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -84,13 +89,14 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(LOGSIZE >= MAXOPBLOCKS + FLUSHBLOCKS && LOGSIZE <= MAXLOG);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nlog + ninodeblocks + nimap + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
@@ -100,10 +106,11 @@ main(int argc, char *argv[])
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.imapstart = xint(2+nlog+ninodeblocks);
+  sb.bmapstart = xint(2+nlog+ninodeblocks+nimap);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, inode map blocks %u, bitmap blocks %u) blocks %d total %d\n",
+         nmeta, nlog, ninodeblocks, nimap, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -120,12 +127,12 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nrootents++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nrootents++] = de;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,7 +159,7 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootents[nrootents++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,14 +167,10 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  writedir(rootino, rootents, nrootents);
 
   balloc(freeblock);
+  iballoc(freeinode);
 
   exit(0);
 }
@@ -247,16 +250,121 @@ balloc(int used)
   wsect(sb.bmapstart, buf);
 }
 
+// Mark inodes [0, used) allocated in the free-inode map;
+// inode 0 is never used.
+void
+iballoc(int used)
+{
+  uchar buf[BSIZE];
+  int i;
+
+  printf("iballoc: first %d inodes have been allocated\n", used);
+  assert(used < BSIZE*8);
+  bzero(buf, BSIZE);
+  for(i = 0; i < used; i++){
+    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  }
+  printf("iballoc: write inode map block at sector %d\n", sb.imapstart);
+  wsect(sb.imapstart, buf);
+}
+
+// The hash of a directory entry name; a copy of the kernel's.
+uint
+dirhashname(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the n entries de, starting with "." and "..", to the
+// empty directory inum: as a hashed directory (see kernel/fs.h)
+// if they don't fit in one block, with the smallest table that
+// needs no overflow blocks.
+void
+writedir(uint inum, struct dirent *de, int n)
+{
+  struct dinode din;
+  uint off, depth, nb, i, b;
+  int count[1 << DIRMAXDEPTH];
+  uchar *buf, *p;
+  struct dirhash *h;
+  struct dirent *slot;
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+    // fix size of the directory
+    rinode(inum, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(inum, &din);
+    return;
+  }
+
+  for(depth = 0; ; depth++){
+    assert(depth <= DIRMAXDEPTH);
+    memset(count, 0, sizeof(count));
+    for(i = 2; i < n; i++)
+      count[dirhashname(de[i].name) & ((1 << depth) - 1)]++;
+    for(b = 0; b < (1 << depth); b++)
+      if(count[b] > DPB - 1)
+        break;
+    if(b == (1 << depth))
+      break;
+  }
+
+  nb = 1 + (1 << depth);
+  buf = calloc(nb, BSIZE);
+  slot = (struct dirent*)buf;
+  slot[0] = de[0];
+  slot[1] = de[1];
+  h = (struct dirhash*)buf + 2;
+  h->depth = xshort(depth);
+  h->magic = xint(DIRMAGIC);
+  for(b = 0; b < (1 << depth); b++){
+    p = buf + (DIRTAB + b/DIRTPS) * sizeof(struct dirent) +
+        sizeof(ushort) + (b%DIRTPS) * sizeof(ushort);
+    *(ushort*)p = xshort(1 + b);
+    ((struct dirbucket*)(buf + (1 + b) * BSIZE))->depth = xshort(depth);
+  }
+  memset(count, 0, sizeof(count));
+  for(i = 2; i < n; i++){
+    b = dirhashname(de[i].name) & ((1 << depth) - 1);
+    slot = (struct dirent*)(buf + (1 + b) * BSIZE);
+    slot[1 + count[b]++] = de[i];
+  }
+  iappend(inum, buf, nb * BSIZE);
+  free(buf);
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of indirect block sec, allocating a block for it
+// if there is none.
+uint
+indirect_entry(uint sec, uint i)
+{
+  uint indirect[NINDIRECT];
+
+  rsect(sec, (char*)indirect);
+  if(indirect[i] == 0){
+    indirect[i] = xint(freeblock++);
+    wsect(sec, (char*)indirect);
+  }
+  return xint(indirect[i]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, fbn1, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -270,16 +378,18 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = indirect_entry(xint(din.addrs[NDIRECT]), fbn - NDIRECT);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      fbn1 = fbn - NDIRECT - NINDIRECT;
+      x = indirect_entry(xint(din.addrs[NDIRECT+1]), fbn1 / NINDIRECT);
+      x = indirect_entry(x, fbn1 % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
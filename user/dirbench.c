@@ -0,0 +1,102 @@
+// Measure the cost of creating, looking up and removing
+// entries in one big directory.
+//
+//   dirbench [nentries]
+//
+// Makes nentries (default 10000) links to one file in a new
+// directory, looks each of them up, and unlinks them, and
+// prints the rate of each. Links need no i-nodes, so the
+// directory can be much bigger than the file system's
+// i-node count.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define TIMEBASE 10000000  // rdtime() ticks per second
+
+// the name of entry i: "dirbench.d/" then a number
+char*
+entname(int i)
+{
+  static char name[32] = "dirbench.d/";
+  char *p = name + 11;
+  char tmp[12];
+  int n = 0;
+
+  do {
+    tmp[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  while(n > 0)
+    *p++ = tmp[--n];
+  *p = 0;
+  return name;
+}
+
+void
+report(char *what, int n, uint64 t0)
+{
+  uint64 t = rdtime() - t0;
+
+  if(t == 0)
+    t = 1;
+  printf("%s: %d in %d ms, %d/s\n", what, n,
+         (int)(t / (TIMEBASE / 1000)), (int)((uint64)n * TIMEBASE / t));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, fd;
+  uint64 t0;
+
+  n = 10000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0){
+    fprintf(2, "usage: dirbench [nentries]\n");
+    exit(1);
+  }
+
+  if(mkdir("dirbench.d") < 0 ||
+     (fd = open("dirbench.f", O_CREATE | O_WRONLY)) < 0){
+    fprintf(2, "dirbench: cannot create dirbench.d or dirbench.f\n");
+    exit(1);
+  }
+  close(fd);
+
+  t0 = rdtime();
+  for(i = 0; i < n; i++){
+    if(link("dirbench.f", entname(i)) < 0){
+      fprintf(2, "dirbench: link %s failed\n", entname(i));
+      exit(1);
+    }
+  }
+  report("create", n, t0);
+
+  // look them up in a different order than they were made.
+  t0 = rdtime();
+  for(i = 0; i < n; i++){
+    if((fd = open(entname((i * 7919) % n), O_RDONLY)) < 0){
+      fprintf(2, "dirbench: open %s failed\n", entname((i * 7919) % n));
+      exit(1);
+    }
+    close(fd);
+  }
+  report("lookup", n, t0);
+
+  t0 = rdtime();
+  for(i = 0; i < n; i++){
+    if(unlink(entname(i)) < 0){
+      fprintf(2, "dirbench: unlink %s failed\n", entname(i));
+      exit(1);
+    }
+  }
+  report("unlink", n, t0);
+
+  unlink("dirbench.d");
+  unlink("dirbench.f");
+  exit(0);
+}
@@ -0,0 +1,48 @@
+// Show or set the disk driver's mode.
+//
+//   diskmode                  print the current mode
+//   diskmode [poll] [coalesce] | none
+//
+// poll:     synchronous waits spin for the completion first.
+// coalesce: under load, one interrupt per several completions
+//           (needs VIRTIO_RING_F_EVENT_IDX).
+
+#include "kernel/types.h"
+#include "kernel/diskmode.h"
+#include "user/user.h"
+
+void
+show(int mode)
+{
+  printf("disk mode:%s%s%s\n",
+         mode & DISK_POLL ? " poll" : "",
+         mode & DISK_EVENTIDX ? " coalesce" : "",
+         mode == 0 ? " none" : "");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, mode;
+
+  if(argc < 2){
+    show(diskmode(-1));
+    exit(0);
+  }
+
+  mode = 0;
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "poll") == 0)
+      mode |= DISK_POLL;
+    else if(strcmp(argv[i], "coalesce") == 0)
+      mode |= DISK_EVENTIDX;
+    else if(strcmp(argv[i], "none") != 0){
+      fprintf(2, "usage: diskmode [poll] [coalesce] | none\n");
+      exit(1);
+    }
+  }
+  diskmode(mode);
+  mode = diskmode(-1);
+  show(mode);
+  exit(0);
+}
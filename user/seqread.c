@@ -0,0 +1,71 @@
+// Time sequential reads of files, to measure read-ahead.
+//
+//   seqread [-b bufsize] [file ...]
+//
+// Reads each file from start to end with read()s of bufsize
+// bytes (default 512, like cat and wc) and prints the rate.
+// Run it on files that aren't in the buffer cache yet, e.g.
+// right after boot, to see the disk rather than the cache.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define TIMEBASE 10000000  // rdtime() ticks per second
+
+char buf[8192];
+
+void
+seqread(char *name, int bsize)
+{
+  int fd, n;
+  uint64 t0, t, total, rate;
+
+  if((fd = open(name, 0)) < 0){
+    fprintf(2, "seqread: cannot open %s\n", name);
+    exit(1);
+  }
+  total = 0;
+  t0 = rdtime();
+  while((n = read(fd, buf, bsize)) > 0)
+    total += n;
+  t = rdtime() - t0;
+  close(fd);
+  if(n < 0){
+    fprintf(2, "seqread: read %s failed\n", name);
+    exit(1);
+  }
+  if(t == 0)
+    t = 1;
+
+  // hundredths of a MB/s.
+  rate = total * TIMEBASE / t * 100 / (1024*1024);
+  printf("%s: %d KB in %d us, %d.%d%d MB/s\n", name, (int)(total / 1024),
+         (int)(t / (TIMEBASE / 1000000)), (int)(rate / 100),
+         (int)(rate / 10 % 10), (int)(rate % 10));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, bsize;
+
+  bsize = 512;
+  i = 1;
+  if(argc > 2 && strcmp(argv[1], "-b") == 0){
+    bsize = atoi(argv[2]);
+    if(bsize <= 0 || bsize > sizeof(buf)){
+      fprintf(2, "seqread: bad bufsize\n");
+      exit(1);
+    }
+    i = 3;
+  }
+
+  if(i == argc){
+    seqread("usertests", bsize);
+    exit(0);
+  }
+  for(; i < argc; i++)
+    seqread(argv[i], bsize);
+  exit(0);
+}
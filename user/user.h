@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -23,6 +24,10 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int sched_setaffinity(int, int);
+int sched_getaffinity(int);
+int getrusage(int, struct rusage*);
+int diskmode(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +45,7 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+uint64 rdtime(void);
+
+// statistics.c
+int statistics(void*, int);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/rusage.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -573,6 +574,9 @@ void
 writebig(char *s)
 {
   int i, fd, n;
+  // well into the doubly-indirect blocks; MAXFILE is
+  // bigger than the file system.
+  int nblocks = NDIRECT + NINDIRECT + 2*NINDIRECT + 3;
 
   fd = open("big", O_CREATE|O_RDWR);
   if(fd < 0){
@@ -580,7 +584,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < nblocks; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -600,7 +604,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != nblocks){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -2706,6 +2710,429 @@ execout(char *s)
   exit(0);
 }
 
+// pin the process to each running hart in turn, and check
+// that the mask is reported back and inherited by fork().
+void
+affinity(char *s)
+{
+  int mask, xst;
+
+  mask = sched_getaffinity(0);
+  if(mask <= 0){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 0) != -1){
+    printf("%s: empty mask accepted\n", s);
+    exit(1);
+  }
+  if(sched_getaffinity(0x7fffffff) != -1){
+    printf("%s: bad pid accepted\n", s);
+    exit(1);
+  }
+
+  for(int i = 0; i < NCPU; i++){
+    if((mask & (1 << i)) == 0)
+      continue;
+    if(sched_setaffinity(0, 1 << i) < 0 || sched_getaffinity(0) != (1 << i)){
+      printf("%s: could not pin to hart %d\n", s, i);
+      exit(1);
+    }
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 100; j++)
+        getpid();
+      exit(sched_getaffinity(0) == (1 << i) ? 0 : 1);
+    }
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: child did not inherit affinity\n", s);
+      exit(1);
+    }
+  }
+
+  if(sched_setaffinity(0, mask) < 0){
+    printf("%s: could not restore affinity\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a child that spins and sleeps should show up in
+// the parent's RUSAGE_CHILDREN totals.
+void
+rusage(char *s)
+{
+  struct rusage self, before, after;
+  int xst;
+
+  if(getrusage(RUSAGE_CHILDREN, &before) < 0){
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  if(getrusage(2, &self) != -1){
+    printf("%s: bad who accepted\n", s);
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    int t0 = uptime();
+    while(uptime() - t0 < 2)
+      ;
+    sleep(1);
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0)
+    exit(1);
+
+  if(getrusage(RUSAGE_CHILDREN, &after) < 0 || getrusage(RUSAGE_SELF, &self) < 0){
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  if(after.utime + after.stime <= before.utime + before.stime){
+    printf("%s: child time not accounted\n", s);
+    exit(1);
+  }
+  if(after.nvcsw <= before.nvcsw){
+    printf("%s: child sleep not counted\n", s);
+    exit(1);
+  }
+  if(self.stime == 0){
+    printf("%s: no system time\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// several processes read and stat the same file, and look up
+// paths through the same directories, at the same time.
+void
+sharedread(char *s)
+{
+  enum { N = 4, SZ = 3000 };
+  char buf[512];
+  struct stat st;
+  int fd, i, j, n, xst;
+
+  mkdir("srdir");
+  fd = open("srdir/file", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += n){
+    n = SZ - i < sizeof(buf) ? SZ - i : sizeof(buf);
+    for(j = 0; j < n; j++)
+      buf[j] = 'a' + (i + j) % 26;
+    if(write(fd, buf, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int iter = 0; iter < 20; iter++){
+        if((fd = open("srdir/file", O_RDONLY)) < 0)
+          exit(1);
+        if(fstat(fd, &st) < 0 || st.size != SZ)
+          exit(1);
+        int tot = 0;
+        while((n = read(fd, buf, sizeof(buf))) > 0){
+          for(j = 0; j < n; j++)
+            if(buf[j] != 'a' + (tot + j) % 26)
+              exit(1);
+          tot += n;
+        }
+        close(fd);
+        if(tot != SZ)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: concurrent read failed\n", s);
+      exit(1);
+    }
+  }
+
+  if(unlink("srdir/file") < 0 || unlink("srdir") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// read-ahead of a file that is then deleted must not leave
+// stale data behind for the file that reuses its blocks.
+void
+readahead(char *s)
+{
+  enum { NB = 40 };
+  char buf[BSIZE];
+  int fd, i, j, k;
+
+  for(k = 0; k < 2; k++){
+    fd = open("rafile", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < NB; i++){
+      memset(buf, 'a' + (k*NB + i) % 26, sizeof(buf));
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+
+    // sequential reads; the first pass stops early, with
+    // read-ahead still in flight, and deletes the file.
+    fd = open("rafile", O_RDONLY);
+    for(i = 0; i < (k == 0 ? 3 : NB); i++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+      for(j = 0; j < sizeof(buf); j++){
+        if(buf[j] != 'a' + (k*NB + i) % 26){
+          printf("%s: block %d has wrong data\n", s, i);
+          exit(1);
+        }
+      }
+    }
+    close(fd);
+    if(unlink("rafile") < 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// small appends are held in memory before their blocks are
+// allocated; reads and other writes must still see them.
+void
+delaywrite(char *s)
+{
+  enum { N = 700, SZ = 7 };
+  char rec[SZ], buf[SZ];
+  struct stat st;
+  int fd, rfd, wfd, i, j;
+
+  unlink("dwfile");
+  fd = open("dwfile", O_CREATE | O_RDWR);
+  rfd = open("dwfile", O_RDONLY);
+  if(fd < 0 || rfd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(rec, 'a' + i % 26, SZ);
+    if(write(fd, rec, SZ) != SZ){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    if(read(rfd, buf, SZ) != SZ || memcmp(buf, rec, SZ) != 0){
+      printf("%s: record %d reads back wrong\n", s, i);
+      exit(1);
+    }
+    if(i == N/2){
+      // overwrite the start of the file mid-stream.
+      wfd = open("dwfile", O_RDWR);
+      if(wfd < 0 || write(wfd, "XYZ", 3) != 3){
+        printf("%s: overwrite failed\n", s);
+        exit(1);
+      }
+      close(wfd);
+    }
+  }
+  if(fstat(fd, &st) < 0 || st.size != N*SZ){
+    printf("%s: wrong size %d\n", s, (int)st.size);
+    exit(1);
+  }
+  close(rfd);
+  close(fd);
+
+  fd = open("dwfile", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, SZ) != SZ){
+      printf("%s: reread failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < SZ; j++){
+      if(buf[j] != (i == 0 && j < 3 ? "XYZ"[j] : 'a' + i % 26)){
+        printf("%s: record %d has wrong data\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: file too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("dwfile");
+}
+
+// name lookups that the directory entry cache answers must
+// follow creates, unlinks and directories whose i-nodes
+// are reused.
+void
+dcache(char *s)
+{
+  int fd, i;
+
+  for(i = 0; i < 4; i++){
+    if(open("dcf", O_RDONLY) >= 0){
+      printf("%s: open of missing file succeeded\n", s);
+      exit(1);
+    }
+    fd = open("dcf", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcf", O_RDONLY)) < 0){
+      printf("%s: open of new file failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcf") < 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+
+    // a new directory, likely with the i-node just freed
+    // by the last one, must have its own "..".
+    if(mkdir(i % 2 ? "dcd1" : "dcd0") < 0 ||
+       mkdir(i % 2 ? "dcd1/sub" : "dcd0/sub") < 0 ||
+       chdir(i % 2 ? "dcd1/sub" : "dcd0/sub") < 0){
+      printf("%s: mkdir failed\n", s);
+      exit(1);
+    }
+    if((fd = open(i % 2 ? "../../dcd1/sub" : "../../dcd0/sub", O_RDONLY)) < 0){
+      printf("%s: .. is wrong\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(chdir("/") < 0 ||
+       unlink(i % 2 ? "dcd1/sub" : "dcd0/sub") < 0 ||
+       unlink(i % 2 ? "dcd1" : "dcd0") < 0){
+      printf("%s: rmdir failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a directory that outgrows one block is hashed; its
+// entries must all still be found, removed and listed.
+void
+hashdir(char *s)
+{
+  enum { N = 300 };
+  char name[16];
+  struct dirent de;
+  int fd, i, n;
+
+  if(mkdir("hd") < 0 || (fd = open("hd/f", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  strcpy(name, "hd/e000");
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if(link("hd/f", name) < 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(i % 2 && unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // read as dirents, only the names should show.
+  if((fd = open("hd", O_RDONLY)) < 0){
+    printf("%s: open hd failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    if(strcmp(de.name, ".") != 0 && strcmp(de.name, "..") != 0 &&
+       strcmp(de.name, "f") != 0 &&
+       (de.name[0] != 'e' || (de.name[3] - '0') % 2 != 0)){
+      printf("%s: stray entry %s\n", s, de.name);
+      exit(1);
+    }
+    n++;
+  }
+  close(fd);
+  if(n != 3 + N/2){
+    printf("%s: %d entries, not %d\n", s, n, 3 + N/2);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i += 2){
+    name[4] = '0' + i / 100;
+    name[5] = '0' + (i / 10) % 10;
+    name[6] = '0' + i % 10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("hd") == 0){
+    printf("%s: unlinked non-empty hd\n", s);
+    exit(1);
+  }
+  if(unlink("hd/f") < 0 || unlink("hd") < 0){
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
+  }
+}
+
 //
 // use sbrk() to count how many free physical memory pages there are.
 // touches the pages to force allocation.
@@ -2880,6 +3307,13 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {affinity, "affinity"},
+    {rusage, "rusage"},
+    {sharedread, "sharedread"},
+    {readahead, "readahead"},
+    {delaywrite, "delaywrite"},
+    {dcache, "dcache"},
+    {hashdir, "hashdir"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
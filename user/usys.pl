@@ -36,3 +36,7 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("getrusage");
+entry("diskmode");
@@ -0,0 +1,87 @@
+// Measure file system write throughput with concurrent writers,
+// to see how well the log groups their system calls into
+// transactions.
+//
+//   writebench [nops]
+//
+// For 1, 2, 4 and 8 writers, each writer does nops (default
+// 200) small writes to its own file, and the total rate of
+// write() system calls is printed.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define TIMEBASE 10000000  // rdtime() ticks per second
+#define WSIZE    512       // bytes per write
+#define FILESZ   (32*WSIZE) // start the file over at this size
+
+char buf[WSIZE];
+
+void
+writer(int id, int nops)
+{
+  char name[] = "wbench0";
+  int fd, i;
+
+  name[6] += id;
+  fd = -1;
+  for(i = 0; i < nops; i++){
+    if(i % (FILESZ / WSIZE) == 0){
+      if(fd >= 0)
+        close(fd);
+      if((fd = open(name, O_CREATE | O_TRUNC | O_WRONLY)) < 0){
+        fprintf(2, "writebench: cannot create %s\n", name);
+        exit(1);
+      }
+    }
+    if(write(fd, buf, WSIZE) != WSIZE){
+      fprintf(2, "writebench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink(name);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nops, nw, i, xst;
+  uint64 t0, t;
+
+  nops = 200;
+  if(argc > 1)
+    nops = atoi(argv[1]);
+  if(nops <= 0){
+    fprintf(2, "usage: writebench [nops]\n");
+    exit(1);
+  }
+  memset(buf, 'w', sizeof(buf));
+
+  for(nw = 1; nw <= 8; nw *= 2){
+    t0 = rdtime();
+    for(i = 0; i < nw; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "writebench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        writer(i, nops);
+    }
+    for(i = 0; i < nw; i++){
+      wait(&xst);
+      if(xst != 0)
+        exit(1);
+    }
+    t = rdtime() - t0;
+    if(t == 0)
+      t = 1;
+    printf("%d writers: %d writes in %d ms, %d writes/s\n", nw, nw*nops,
+           (int)(t / (TIMEBASE / 1000)), (int)((uint64)nw * nops * TIMEBASE / t));
+  }
+  exit(0);
+}